@@ -1,31 +1,193 @@
+// MAP_ANONYMOUS isn't POSIX, glibc only declares it under -std=c11 if asked
+#define _DEFAULT_SOURCE
+
 #include "allocator.h"
 #include "defines.h"
 #include "log.h"
 #include <assert.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
-static linear_allocator_t *root_allocator = NULL;
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#if defined(ALLOCATOR_USE_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+#define ALLOCATOR_ADVISE_HUGE_PAGES
+#endif
+
+// Each thread allocates from its own arena, so no locking is needed.  A
+// thread must call initialize_allocator before allocating.
+static _Thread_local linear_allocator_t *root_allocator = NULL;
+
+// Per call site statistics are only gathered once allocator_enable_stats has
+// been called.  The flag is process wide and should be set before any worker
+// threads start, the tables themselves live with each arena.  It's atomic as
+// every thread reads it, relaxed loads are plain loads on common targets.
+static _Atomic b8 stats_enabled = FALSE;
+
+static b8 allocator_stats_enabled() {
+  return atomic_load_explicit(&stats_enabled, memory_order_relaxed);
+}
+
+// Finds (or claims) the statistics slot for a call site in the arena's table.
+static allocator_call_site_t *allocator_find_site(linear_allocator_t *arena,
+                                                  char *file, u32 line) {
+  // Kept outside of the arena so it doesn't skew the numbers
+  if (arena->call_sites == NULL) {
+    arena->call_sites =
+        calloc(ALLOCATOR_MAX_CALL_SITES, sizeof(allocator_call_site_t));
+    if (arena->call_sites == NULL)
+      return NULL;
+  }
+  // Keyed on the contents of __FILE__, identical paths in different
+  // translation units needn't share a pointer
+  u64 hash = line;
+  for (const char *c = file; *c; c++)
+    hash = hash * 31 + (u8)*c;
+  hash %= ALLOCATOR_MAX_CALL_SITES;
+  // Linear probe for the call site
+  for (u32 i = 0; i < ALLOCATOR_MAX_CALL_SITES; i++) {
+    allocator_call_site_t *site =
+        &arena->call_sites[(hash + i) % ALLOCATOR_MAX_CALL_SITES];
+    if (site->file == NULL) {
+      site->file = file;
+      site->line = line;
+      arena->call_site_count++;
+    }
+    if (site->line == line &&
+        (site->file == file || strcmp(site->file, file) == 0))
+      return site;
+  }
+  return NULL;
+}
+
+static void allocator_record(char *file, u32 line, u64 bytes) {
+  allocator_call_site_t *site = allocator_find_site(root_allocator, file, line);
+  if (site) {
+    site->bytes += bytes;
+    site->count += 1;
+  }
+}
+
+// Chunk memory comes straight from the OS where possible.  Mapped pages are
+// zeroed and only become resident once touched, large chunks additionally
+// ask for transparent huge pages to cut down on TLB misses.
+static i8 *linear_allocator_map_memory(u64 bytes) {
+#ifndef _WIN32
+#ifdef ALLOCATOR_ADVISE_HUGE_PAGES
+  // Huge pages only back whole, aligned huge page ranges.  bytes is already
+  // a multiple of the huge page size (see linear_allocator_new_chunk), the
+  // mapping is made a huge page bigger and trimmed to an aligned start.
+  if (bytes >= ALLOCATOR_HUGE_PAGE_SIZE) {
+    u64 mapped = bytes + ALLOCATOR_HUGE_PAGE_SIZE;
+    i8 *raw = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+      return NULL;
+    u64 head = (ALLOCATOR_HUGE_PAGE_SIZE -
+                (uintptr_t)raw % ALLOCATOR_HUGE_PAGE_SIZE) %
+               ALLOCATOR_HUGE_PAGE_SIZE;
+    if (head)
+      munmap(raw, head);
+    if (mapped - head > bytes)
+      munmap(raw + head + bytes, mapped - head - bytes);
+    madvise(raw + head, bytes, MADV_HUGEPAGE);
+    return raw + head;
+  }
+#endif
+  void *mem_ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem_ptr == MAP_FAILED)
+    return NULL;
+  return mem_ptr;
+#else
+  return calloc(bytes, 1);
+#endif
+}
+
+static void linear_allocator_unmap_memory(i8 *mem_ptr, u64 bytes) {
+#ifndef _WIN32
+  munmap(mem_ptr, bytes);
+#else
+  free(mem_ptr);
+#endif
+}
 
 static allocator_memory_chunk_t *
 linear_allocator_new_chunk(uint64_t amount_to_alloc) {
+  // Round up to whole pages, the remainder would be wasted anyway
+  u64 page_size = ALLOCATOR_PAGE_SIZE;
+#ifdef ALLOCATOR_ADVISE_HUGE_PAGES
+  if (amount_to_alloc >= ALLOCATOR_HUGE_PAGE_SIZE)
+    page_size = ALLOCATOR_HUGE_PAGE_SIZE;
+#endif
+  amount_to_alloc = (amount_to_alloc + page_size - 1) & ~(page_size - 1);
   allocator_memory_chunk_t *new_chunk =
       calloc(sizeof(allocator_memory_chunk_t), 1);
-  int8_t *mem_ptr = calloc(amount_to_alloc, 1);
+  int8_t *mem_ptr = linear_allocator_map_memory(amount_to_alloc);
   if (new_chunk != NULL && mem_ptr != NULL) { // Success
     new_chunk->mem_ptr = mem_ptr;
     new_chunk->valid = TRUE;
     new_chunk->capacity = amount_to_alloc;
     new_chunk->free_space = amount_to_alloc;
     new_chunk->next = NULL;
+    if (root_allocator) {
+      root_allocator->chunk_count += 1;
+      root_allocator->bytes_reserved += amount_to_alloc;
+    }
     return new_chunk;
   }
+  free(new_chunk);
+  if (mem_ptr != NULL)
+    linear_allocator_unmap_memory(mem_ptr, amount_to_alloc);
   return NULL;
 }
 
-void *imust_alloc(u64 bytes) {
+// Small allocations that don't fit in the current chunk are first offered to
+// the spare chunk, so the space left at the end of earlier chunks isn't
+// wasted without having to search them all.
+static allocator_memory_chunk_t *linear_allocator_find_chunk(u64 bytes) {
+  allocator_memory_chunk_t *spare = root_allocator->spare_chunk;
+  if (bytes > ALLOCATOR_SMALL_ALLOCATION || spare == NULL ||
+      spare->free_space < bytes)
+    return NULL;
+  return spare;
+}
+
+// Adds a new chunk big enough for `bytes`.  Chunk sizes double each time, up
+// to ALLOCATOR_MAX_CHUNK_SIZE, so big compiles use a few large chunks rather
+// than many small ones.  The new chunk only takes over as the current chunk
+// when it has more room left than the current one, an oversized allocation
+// doesn't cause the rest of the current chunk to be abandoned.  A chunk that
+// stops being current becomes the spare if it has more room than the spare.
+static allocator_memory_chunk_t *linear_allocator_grow(u64 bytes) {
+  u64 chunk_size = root_allocator->chunk_size;
+  allocator_memory_chunk_t *chunk =
+      linear_allocator_new_chunk(bytes > chunk_size ? bytes : chunk_size);
+  if (chunk == NULL)
+    return NULL;
+  if (chunk_size < ALLOCATOR_MAX_CHUNK_SIZE)
+    root_allocator->chunk_size = chunk_size * 2;
+
+  root_allocator->tail->next = chunk;
+  root_allocator->tail = chunk;
+  allocator_memory_chunk_t *current = root_allocator->current_chunk;
+  if (chunk->free_space - bytes > current->free_space) {
+    allocator_memory_chunk_t *spare = root_allocator->spare_chunk;
+    if (spare == NULL || current->free_space > spare->free_space)
+      root_allocator->spare_chunk = current;
+    root_allocator->current_chunk = chunk;
+  }
+  return chunk;
+}
+
+void *_imust_alloc(char *file, u32 line, u64 bytes) {
   if (root_allocator) {
-    void *mem_ptr = ialloc(bytes);
+    void *mem_ptr = _ialloc(file, line, bytes);
     if (mem_ptr) {
       return mem_ptr;
     } else {
@@ -39,26 +201,25 @@ void *imust_alloc(u64 bytes) {
   }
 }
 
-void *ialloc(u64 bytes) {
+void *_ialloc(char *file, u32 line, u64 bytes) {
   if (root_allocator) {
+    if (allocator_stats_enabled())
+      allocator_record(file, line, bytes);
     allocator_memory_chunk_t *chunk = root_allocator->current_chunk;
 
     // Handle overflow
     if (bytes > chunk->free_space) {
-      chunk = bytes > root_allocator->chunk_size
-                  ? linear_allocator_new_chunk(bytes)
-                  : linear_allocator_new_chunk(root_allocator->chunk_size);
-      if (chunk != NULL) {
-        root_allocator->current_chunk->next = chunk;
-        root_allocator->current_chunk = chunk;
-      } else {
+      chunk = linear_allocator_find_chunk(bytes);
+      if (chunk == NULL)
+        chunk = linear_allocator_grow(bytes);
+      if (chunk == NULL)
         return NULL;
-      }
     }
     void *mem_ptr = chunk->mem_ptr + (chunk->capacity - chunk->free_space);
     // Clear the memory
     memset(mem_ptr, 0x0, bytes);
     chunk->free_space -= bytes;
+    root_allocator->last_chunk = chunk;
     return mem_ptr;
   } else {
     WARN("Allocation requested before allocator was initialized.  Using raw "
@@ -67,22 +228,106 @@ void *ialloc(u64 bytes) {
   }
 }
 
+// Resize an allocation.  When the allocation is the most recent one handed
+// out, from whichever chunk, it can simply be grown (or shrunk) in place,
+// otherwise fall back to allocating a new block and copying the old contents
+// over.  The caller must supply the size the allocation was made with, the
+// linear allocator doesn't track it.
+void *_irealloc(char *file, u32 line, void *mem_ptr, u64 old_bytes,
+                u64 new_bytes) {
+  if (mem_ptr == NULL)
+    return _ialloc(file, line, new_bytes);
+  if (root_allocator && root_allocator->last_chunk) {
+    allocator_memory_chunk_t *chunk = root_allocator->last_chunk;
+    i8 *top = chunk->mem_ptr + (chunk->capacity - chunk->free_space);
+    if ((i8 *)mem_ptr + old_bytes == top) {
+      if (new_bytes <= old_bytes) {
+        chunk->free_space += old_bytes - new_bytes;
+        return mem_ptr;
+      } else if (new_bytes - old_bytes <= chunk->free_space) {
+        if (allocator_stats_enabled())
+          allocator_record(file, line, new_bytes - old_bytes);
+        // Clear the newly claimed memory, same as ialloc
+        memset(top, 0x0, new_bytes - old_bytes);
+        chunk->free_space -= new_bytes - old_bytes;
+        return mem_ptr;
+      }
+    }
+  }
+  // Shrinking something that isn't on top, just keep using it.
+  if (new_bytes <= old_bytes)
+    return mem_ptr;
+  void *new_ptr = _ialloc(file, line, new_bytes);
+  if (new_ptr) {
+    memcpy(new_ptr, mem_ptr, old_bytes);
+  }
+  return new_ptr;
+}
+
+void *_imust_realloc(char *file, u32 line, void *mem_ptr, u64 old_bytes,
+                     u64 new_bytes) {
+  void *new_ptr = _irealloc(file, line, mem_ptr, old_bytes, new_bytes);
+  if (new_ptr == NULL) {
+    FATAL("Could not reallocate %li bytes of memory\n", new_bytes);
+  }
+  return new_ptr;
+}
+
 // A no-op for now
 void ifree(void *mem) {}
 
+// Releases the calling thread's arena, along with any arenas it adopted.
 void shutdown_allocator() {
   if (root_allocator) {
     allocator_memory_chunk_t *head = root_allocator->head;
     allocator_memory_chunk_t *next = root_allocator->head->next;
     while (head != NULL) {
-      free(head->mem_ptr);
+      linear_allocator_unmap_memory(head->mem_ptr, head->capacity);
       free(head);
       head = next;
       if (head != NULL)
         next = head->next;
     }
+    free(root_allocator->call_sites);
     free(root_allocator);
+    root_allocator = NULL;
+  }
+}
+
+// Hands the calling thread's arena over to whoever needs the memory to
+// outlive the thread.  The thread must not allocate again until it calls
+// initialize_allocator.
+linear_allocator_t *allocator_detach() {
+  linear_allocator_t *arena = root_allocator;
+  root_allocator = NULL;
+  return arena;
+}
+
+// Takes ownership of an arena detached from another thread.  Its chunks are
+// spliced onto the calling thread's arena, so everything allocated in it
+// stays valid and is released by this thread's shutdown_allocator.
+void allocator_adopt(linear_allocator_t *arena) {
+  if (arena == NULL || root_allocator == NULL)
+    return;
+  root_allocator->tail->next = arena->head;
+  root_allocator->tail = arena->tail;
+  root_allocator->chunk_count += arena->chunk_count;
+  root_allocator->bytes_reserved += arena->bytes_reserved;
+  if (arena->call_sites) {
+    for (u32 i = 0; i < ALLOCATOR_MAX_CALL_SITES; i++) {
+      allocator_call_site_t *site = &arena->call_sites[i];
+      if (site->file == NULL)
+        continue;
+      allocator_call_site_t *merged =
+          allocator_find_site(root_allocator, site->file, site->line);
+      if (merged) {
+        merged->bytes += site->bytes;
+        merged->count += site->count;
+      }
+    }
+    free(arena->call_sites);
   }
+  free(arena);
 }
 
 b8 initialize_allocator() {
@@ -92,6 +337,7 @@ b8 initialize_allocator() {
         linear_allocator_new_chunk(DEFAULT_CHUNK_SIZE);
     if (chunk != NULL) {
       root_allocator->head = chunk;
+      root_allocator->tail = chunk;
       root_allocator->current_chunk = chunk;
       root_allocator->chunk_size = DEFAULT_CHUNK_SIZE;
       return TRUE;
@@ -99,3 +345,83 @@ b8 initialize_allocator() {
   }
   return FALSE;
 }
+
+void allocator_enable_stats() {
+  atomic_store_explicit(&stats_enabled, TRUE, memory_order_relaxed);
+}
+
+// Bytes handed out so far.  Walks the chunk list rather than keeping a
+// running total so allocations don't pay anything for it.
+u64 allocator_bytes_used() {
+  u64 used = 0;
+  if (root_allocator) {
+    for (allocator_memory_chunk_t *chunk = root_allocator->head; chunk != NULL;
+         chunk = chunk->next) {
+      used += chunk->capacity - chunk->free_space;
+    }
+  }
+  return used;
+}
+
+// Peak resident set size of the process in kilobytes, 0 if unknown.
+u64 allocator_peak_resident_kb() {
+#ifndef _WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    return (u64)usage.ru_maxrss;
+#endif
+  return 0;
+}
+
+static int compare_sites_by_bytes(const void *a, const void *b) {
+  const allocator_call_site_t *sa = a, *sb = b;
+  return sa->bytes < sb->bytes ? 1 : sa->bytes > sb->bytes ? -1 : 0;
+}
+
+static int compare_sites_by_count(const void *a, const void *b) {
+  const allocator_call_site_t *sa = a, *sb = b;
+  return sa->count < sb->count ? 1 : sa->count > sb->count ? -1 : 0;
+}
+
+static void print_sites(FILE *out, allocator_call_site_t *sites, u32 count) {
+  for (u32 i = 0; i < count; i++) {
+    fprintf(out, "  %10" PRIu64 " bytes %8" PRIu64 " allocs  %s:%u\n",
+            sites[i].bytes, sites[i].count, sites[i].file, sites[i].line);
+  }
+}
+
+void allocator_print_stats(FILE *out, u32 top_n) {
+  if (root_allocator) {
+    fprintf(out,
+            "Chunks: %" PRIu64 " (%" PRIu64 " bytes reserved, %" PRIu64
+            " bytes used)\n",
+            root_allocator->chunk_count, root_allocator->bytes_reserved,
+            allocator_bytes_used());
+  }
+  fprintf(out, "Peak resident set: %" PRIu64 " KiB\n",
+          allocator_peak_resident_kb());
+  if (!allocator_stats_enabled() || root_allocator == NULL ||
+      root_allocator->call_site_count == 0)
+    return;
+
+  // Compact the call site table so it can be sorted
+  allocator_call_site_t *sites =
+      calloc(root_allocator->call_site_count, sizeof(allocator_call_site_t));
+  if (sites == NULL)
+    return;
+  u32 count = 0;
+  for (u32 i = 0; i < ALLOCATOR_MAX_CALL_SITES; i++) {
+    if (root_allocator->call_sites[i].file != NULL)
+      sites[count++] = root_allocator->call_sites[i];
+  }
+  u32 shown = count < top_n ? count : top_n;
+
+  qsort(sites, count, sizeof(allocator_call_site_t), compare_sites_by_bytes);
+  fprintf(out, "Top allocation sites by bytes:\n");
+  print_sites(out, sites, shown);
+
+  qsort(sites, count, sizeof(allocator_call_site_t), compare_sites_by_count);
+  fprintf(out, "Top allocation sites by count:\n");
+  print_sites(out, sites, shown);
+  free(sites);
+}
@@ -1,9 +1,21 @@
 #pragma once
 
 #include "defines.h"
+#include <stdio.h>
 
-// 128k chunks
+// 128k chunks to start with, each new chunk doubles in size up to 64M
 #define DEFAULT_CHUNK_SIZE 128 * 1024
+#define ALLOCATOR_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define ALLOCATOR_PAGE_SIZE 4096
+
+// Allocations up to this size will be placed in the spare chunk if it has
+// room left, rather than forcing a new chunk.
+#define ALLOCATOR_SMALL_ALLOCATION 256
+
+// Comment out to stop asking for transparent huge pages on large chunks.
+// Chunks of at least a huge page are sized and aligned to whole huge pages.
+#define ALLOCATOR_USE_HUGE_PAGES
+#define ALLOCATOR_HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 typedef struct allocator_memory_chunk_t {
   i8 *mem_ptr;
@@ -13,15 +25,68 @@ typedef struct allocator_memory_chunk_t {
   struct allocator_memory_chunk_t *next;
 } allocator_memory_chunk_t;
 
+// How many distinct allocation call sites statistics are kept for.
+#define ALLOCATOR_MAX_CALL_SITES 1024
+
+typedef struct allocator_call_site_t {
+  char *file;
+  u32 line;
+  u64 bytes;
+  u64 count;
+} allocator_call_site_t;
+
 typedef struct linear_allocator_t {
   allocator_memory_chunk_t *head;
+  allocator_memory_chunk_t *tail;
   allocator_memory_chunk_t *current_chunk;
+  // The earlier chunk with the most room left, for small allocations that
+  // don't fit in the current one
+  allocator_memory_chunk_t *spare_chunk;
+  // Where the latest allocation came from, the only one realloc can grow in
+  // place
+  allocator_memory_chunk_t *last_chunk;
   uint64_t chunk_size;
+  u64 chunk_count;
+  u64 bytes_reserved;
+  // Only allocated when statistics are enabled
+  allocator_call_site_t *call_sites;
+  u32 call_site_count;
 } linear_allocator_t;
 
+// Every thread allocates from its own arena, selected through a thread local
+// so allocations never lock.  Each thread that allocates must call
+// initialize_allocator first, and shutdown_allocator when it's done.
+//
+// Memory belongs to the arena of the thread that allocated it.  Data that
+// has to outlive its thread (AST nodes built by a parser worker, say) is
+// handed over by having the worker call allocator_detach once it's finished
+// allocating, and the receiving thread pass the result to allocator_adopt.
+// The adopted chunks are then released with the receiver's arena.
 b8 initialize_allocator();
 void shutdown_allocator();
+linear_allocator_t *allocator_detach();
+void allocator_adopt(linear_allocator_t *);
 
-void *imust_alloc(u64 bytes);
-void *ialloc(u64 bytes);
+void *_imust_alloc(char *file, u32 line, u64 bytes);
+void *_ialloc(char *file, u32 line, u64 bytes);
+void *_imust_realloc(char *file, u32 line, void *mem_ptr, u64 old_bytes,
+                     u64 new_bytes);
+void *_irealloc(char *file, u32 line, void *mem_ptr, u64 old_bytes,
+                u64 new_bytes);
 void ifree(void *mem_ptr);
+
+// Allocation entry points capture their call site so allocator statistics
+// can attribute memory to the code that asked for it.
+#define imust_alloc(bytes) _imust_alloc(__FILE__, __LINE__, bytes)
+#define ialloc(bytes) _ialloc(__FILE__, __LINE__, bytes)
+#define imust_realloc(mem_ptr, old_bytes, new_bytes)                           \
+  _imust_realloc(__FILE__, __LINE__, mem_ptr, old_bytes, new_bytes)
+#define irealloc(mem_ptr, old_bytes, new_bytes)                                \
+  _irealloc(__FILE__, __LINE__, mem_ptr, old_bytes, new_bytes)
+
+// Statistics.  Call site tracking is off until enabled, the rest is computed
+// on demand.
+void allocator_enable_stats();
+u64 allocator_bytes_used();
+u64 allocator_peak_resident_kb();
+void allocator_print_stats(FILE *out, u32 top_n);
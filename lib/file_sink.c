@@ -0,0 +1,153 @@
+// ftruncate is only declared under -std=c11 if POSIX is asked for
+#define _POSIX_C_SOURCE 200809L
+
+#include "file_sink.h"
+#include "defines.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// write(2) and friends may write less than asked for, keep going until
+// everything is out.
+static b8 file_sink_writev_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    while (count > 0 && (u64)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return TRUE;
+}
+
+static b8 file_sink_map(file_sink_t *sink, u64 capacity) {
+  if (ftruncate(sink->fd, capacity) != 0)
+    return FALSE;
+  char *view = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    sink->fd, 0);
+  if (view == MAP_FAILED)
+    return FALSE;
+  if (sink->buffer)
+    munmap(sink->buffer, sink->capacity);
+  sink->buffer = view;
+  sink->capacity = capacity;
+  return TRUE;
+}
+#endif
+
+b8 file_sink_open(file_sink_t *sink, const char *path, b8 mapped) {
+  memset(sink, 0, sizeof(file_sink_t));
+#ifndef _WIN32
+  sink->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (sink->fd < 0)
+    return FALSE;
+  sink->mapped = mapped;
+  if (mapped) {
+    if (file_sink_map(sink, FILE_SINK_MAP_GROWTH))
+      return TRUE;
+    close(sink->fd);
+    return FALSE;
+  }
+#else
+  sink->file = fopen(path, "wb");
+  if (sink->file == NULL)
+    return FALSE;
+#endif
+  sink->buffer = malloc(FILE_SINK_BLOCK_SIZE);
+  sink->capacity = FILE_SINK_BLOCK_SIZE;
+  if (sink->buffer)
+    return TRUE;
+#ifndef _WIN32
+  close(sink->fd);
+#else
+  fclose(sink->file);
+#endif
+  return FALSE;
+}
+
+b8 file_sink_flush(file_sink_t *sink) {
+  if (sink->mapped || sink->used == 0)
+    return TRUE;
+#ifndef _WIN32
+  struct iovec iov = {.iov_base = sink->buffer, .iov_len = sink->used};
+  b8 result = file_sink_writev_all(sink->fd, &iov, 1);
+#else
+  b8 result = fwrite(sink->buffer, 1, sink->used, sink->file) == sink->used;
+#endif
+  sink->used = 0;
+  return result;
+}
+
+b8 file_sink_write(file_sink_t *sink, const char *data, u64 length) {
+#ifndef _WIN32
+  if (sink->mapped) {
+    if (sink->used + length > sink->capacity) {
+      u64 capacity = sink->capacity * 2;
+      if (capacity < sink->used + length + FILE_SINK_MAP_GROWTH)
+        capacity = sink->used + length + FILE_SINK_MAP_GROWTH;
+      if (!file_sink_map(sink, capacity))
+        return FALSE;
+    }
+    memcpy(&sink->buffer[sink->used], data, length);
+    sink->used += length;
+    return TRUE;
+  }
+  if (length >= sink->capacity) {
+    // Too big to be worth copying, send it along with the pending block
+    struct iovec iov[2] = {
+        {.iov_base = sink->buffer, .iov_len = sink->used},
+        {.iov_base = (void *)data, .iov_len = length},
+    };
+    b8 result = file_sink_writev_all(sink->fd, iov, 2);
+    sink->used = 0;
+    return result;
+  }
+#endif
+  if (sink->used + length > sink->capacity && !file_sink_flush(sink))
+    return FALSE;
+#ifdef _WIN32
+  if (length >= sink->capacity)
+    return fwrite(data, 1, length, sink->file) == length;
+#endif
+  memcpy(&sink->buffer[sink->used], data, length);
+  sink->used += length;
+  return TRUE;
+}
+
+b8 file_sink_close(file_sink_t *sink) {
+  b8 result = TRUE;
+#ifndef _WIN32
+  if (sink->mapped) {
+    if (sink->buffer)
+      munmap(sink->buffer, sink->capacity);
+    // The mapping was grown ahead of time, cut off the unused tail
+    result = ftruncate(sink->fd, sink->used) == 0;
+  } else {
+    result = file_sink_flush(sink);
+    free(sink->buffer);
+  }
+  result = close(sink->fd) == 0 && result;
+#else
+  result = file_sink_flush(sink);
+  free(sink->buffer);
+  result = fclose(sink->file) == 0 && result;
+#endif
+  sink->buffer = NULL;
+  return result;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "defines.h"
+#include <stdio.h>
+
+// Writes are gathered into blocks of this size before going to the file.
+#define FILE_SINK_BLOCK_SIZE (64 * 1024)
+
+// The mapping is grown in steps of at least this many bytes.
+#define FILE_SINK_MAP_GROWTH (1024 * 1024)
+
+// An output file that is written front to back.  By default data is gathered
+// into a fixed size block which is handed to write(2) whenever it fills up,
+// writes larger than a block skip the copy and go out together with the
+// pending block in a single writev(2).  A mapped sink instead copies
+// straight into an mmap'd view of the file, growing it as needed.
+//
+// Either way memory use is independent of how much is written.  Windows
+// falls back to stdio.
+typedef struct file_sink_t {
+#ifndef _WIN32
+  int fd;
+#else
+  FILE *file;
+#endif
+  b8 mapped;
+  char *buffer;
+  // Bytes held in buffer, for a mapped sink the bytes written so far
+  u64 used;
+  u64 capacity;
+} file_sink_t;
+
+b8 file_sink_open(file_sink_t *, const char *path, b8 mapped);
+b8 file_sink_write(file_sink_t *, const char *data, u64 length);
+b8 file_sink_flush(file_sink_t *);
+// Flushes whatever is pending, trims a mapped file to its real size and
+// closes it.
+b8 file_sink_close(file_sink_t *);
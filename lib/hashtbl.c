@@ -8,7 +8,7 @@
 uint32_t str_hash(str s, uint64_t table_capacity) {
   uint32_t seed = 0xC0FFEE;
   uint32_t hash;
-  MurmurHash3_x86_32(s.ptr, s.length, seed, &hash);
+  MurmurHash3_x86_32(str_ptr(&s), str_len(s), seed, &hash);
   return hash % table_capacity;
 }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "rt/small_vec.h"
+
 #include "symbol_table.h"
 #include "tokenize.h"
 #include "types.h"
@@ -24,7 +26,10 @@ typedef enum {
 
 typedef struct ast_node_t ast_node_t;
 
-typedef struct ast_node_t da_nodes;
+// Child node lists.  Most blocks, parameter lists and argument lists only
+// have a handful of entries, so those are kept inline in the parent node.
+#define AST_NODE_LIST_INLINE_CAPACITY 4
+typedef small_vec(ast_node_t *, AST_NODE_LIST_INLINE_CAPACITY) ast_node_list_t;
 
 typedef struct {
   union {
@@ -36,6 +41,9 @@ typedef struct {
 
 typedef struct {
   char *value;
+  // What the name refers to, bound once by the resolver (see resolver.h).
+  // NULL if it's undefined.
+  symbol_table_entry_t *entry;
 } symbol_t;
 
 typedef struct {
@@ -70,7 +78,7 @@ typedef struct {
 } return_t;
 
 typedef struct block_t {
-  da_nodes *nodes;
+  ast_node_list_t nodes;
   symbol_table_t *symbol_table;
   ast_node_t *return_statement;
 } block_t;
@@ -84,7 +92,7 @@ typedef struct {
 
 typedef struct {
   ast_node_t *symbol;
-  da_nodes *parameters;
+  ast_node_list_t parameters;
   symbol_table_t *parameters_symbol_table;
   e_token_type return_type;
   ast_node_t *block;
@@ -92,14 +100,21 @@ typedef struct {
 
 typedef struct fn_call_t {
   ast_node_t *symbol;
-  da_nodes *exprs;
+  ast_node_list_t exprs;
 } fn_call_t;
 
+// resolved_type of a node the typechecker hasn't reached, nodes start out
+// zeroed
+#define AST_TYPE_UNRESOLVED _token_types_start
+
 typedef struct ast_node_t {
   e_ast_node_type type;
   token_t *starting_token;
   uint32_t total_tokens;
   uint32_t line, column;
+  // Type of an expression node, filled in once by the typechecker, bottom
+  // up, the first time it's asked for.  Later passes read it from here.
+  e_token_type resolved_type;
   union {
     literal_t literal;
     symbol_t symbol;
@@ -1,5 +1,6 @@
 #include "c11.h"
 #include "../../lib/assert.h"
+#include "../../lib/log.h"
 #include "../rt/darray.h"
 #include "../rt/str_builder.h"
 
@@ -14,6 +15,69 @@ static const char *ika_type_to_c(e_token_type type) {
   return c11_op_codes[type];
 }
 
+// Writes value as a C string literal, escaping anything that can't appear
+// in one as is.
+static void build_c_string(str_builder_t *sb, const char *value, u64 length) {
+  str_builder_append(sb, (char)'"');
+  for (u64 i = 0; i < length; i++) {
+    char c = value[i];
+    switch (c) {
+    case '\n':
+      str_builder_append(sb, "\\n");
+      break;
+    case '\t':
+      str_builder_append(sb, "\\t");
+      break;
+    case '"':
+      str_builder_append(sb, "\\\"");
+      break;
+    case '\\':
+      str_builder_append(sb, "\\\\");
+      break;
+    default:
+      str_builder_append(sb, c);
+    }
+  }
+  str_builder_append(sb, (char)'"');
+}
+
+// Refers to the pooled constant for a string literal, defining it the first
+// time the literal is seen.  The length is worked out here rather than by
+// cstr every time the expression runs.
+static void build_str_literal(c11_be_t *b, const char *value) {
+  str key = cstr(value);
+  str_entry_t *entry = hashtbl_str_lookup(b->literal_ids, key);
+  u64 id;
+  if (entry) {
+    id = (u64)(uintptr_t)entry->value;
+  } else {
+    id = b->literal_count++;
+    hashtbl_str_insert(b->literal_ids,
+                       (str_entry_t){.key = key,
+                                     .valid = TRUE,
+                                     .value = (void *)(uintptr_t)id});
+    str_builder_append(b->literals, "static const str I_str_");
+    str_builder_append(b->literals, (i64)id);
+    str_builder_append(b->literals, " = {.ptr = ");
+    build_c_string(b->literals, value, str_len(key));
+    str_builder_append(b->literals, ", .length = ");
+    str_builder_append(b->literals, (i64)str_len(key));
+    str_builder_append(b->literals, "};\n");
+  }
+  str_builder_append(b->sb, "I_str_");
+  str_builder_append(b->sb, (i64)id);
+}
+
+// C has no negative literals, -9223372036854775808 negates a constant too
+// big for any signed type, so INT64_MIN is spelled out.
+static void build_int_literal(c11_be_t *b, i64 value) {
+  if (value == INT64_MIN) {
+    str_builder_append(b->sb, "(-9223372036854775807LL - 1)");
+  } else {
+    str_builder_append(b->sb, value);
+  }
+}
+
 static void build_expr(c11_be_t *b, ast_node_t *node) {
   switch (node->type) {
   case ast_expr:
@@ -35,15 +99,13 @@ static void build_expr(c11_be_t *b, ast_node_t *node) {
     str_builder_append(b->sb, ")");
     break;
   case ast_int_literal:
-    str_builder_append(b->sb, node->literal.integer_value);
+    build_int_literal(b, node->literal.integer_value);
     break;
   case ast_float_literal:
     str_builder_append(b->sb, node->literal.float_value);
     break;
   case ast_str_literal:
-    str_builder_append(b->sb, "cstr(\"");
-    str_builder_append(b->sb, node->literal.string_value);
-    str_builder_append(b->sb, "\")");
+    build_str_literal(b, node->literal.string_value);
     break;
   case ast_bool_literal:
     str_builder_append(b->sb, node->literal.integer_value == 0 ? cstr("FALSE")
@@ -68,9 +130,9 @@ static void build_fn_call(c11_be_t *b, ast_node_t *node) {
   str_builder_append(b->sb, "I_");
   str_builder_append(b->sb, fn_call.symbol->symbol.value);
   str_builder_append(b->sb, "(");
-  for (int i = 0; i < darray_len(fn_call.exprs); i++) {
-    build_expr(b, &fn_call.exprs[i]);
-    if (i < darray_len(fn_call.exprs) - 1)
+  for (int i = 0; i < small_vec_len(fn_call.exprs); i++) {
+    build_expr(b, small_vec_get(fn_call.exprs, i));
+    if (i < small_vec_len(fn_call.exprs) - 1)
       str_builder_append(b->sb, ", ");
   }
   str_builder_append(b->sb, ")");
@@ -91,28 +153,359 @@ static void build_decl(c11_be_t *b, ast_node_t *node) {
   str_builder_append(b->sb, ";\n");
 }
 
+static f64 constant_as_float(c11_constant_t *value) {
+  return value->type == TOKEN_FLOAT ? value->float_value
+                                    : (f64)value->integer_value;
+}
+
+// Folds a binary operation following C's rules, as that's what the
+// generated code would have done at runtime.  Division by zero and results
+// that aren't finite are left for runtime.
+static b8 eval_binary_op(e_token_type op, c11_constant_t *left,
+                         c11_constant_t *right, c11_constant_t *result) {
+  if (left->type == TOKEN_STR || right->type == TOKEN_STR)
+    return FALSE;
+  if (left->type == TOKEN_FLOAT || right->type == TOKEN_FLOAT) {
+    f64 l = constant_as_float(left), r = constant_as_float(right);
+    result->type = TOKEN_FLOAT;
+    switch (op) {
+    case TOKEN_ADD:
+      result->float_value = l + r;
+      break;
+    case TOKEN_SUB:
+      result->float_value = l - r;
+      break;
+    case TOKEN_MUL:
+      result->float_value = l * r;
+      break;
+    case TOKEN_QUO:
+      if (r == 0.0)
+        return FALSE;
+      result->float_value = l / r;
+      break;
+    default:
+      result->type = TOKEN_BOOL;
+      switch (op) {
+      case TOKEN_EQL:
+        result->integer_value = l == r;
+        break;
+      case TOKEN_NEQ:
+        result->integer_value = l != r;
+        break;
+      case TOKEN_LT:
+        result->integer_value = l < r;
+        break;
+      case TOKEN_GT:
+        result->integer_value = l > r;
+        break;
+      case TOKEN_LTE:
+        result->integer_value = l <= r;
+        break;
+      case TOKEN_GTE:
+        result->integer_value = l >= r;
+        break;
+      default:
+        return FALSE;
+      }
+    }
+    return result->type != TOKEN_FLOAT ||
+           (result->float_value == result->float_value &&
+            result->float_value - result->float_value == 0.0);
+  }
+  // Wrap around through u64 rather than overflowing
+  u64 l = (u64)left->integer_value, r = (u64)right->integer_value;
+  result->type = TOKEN_INT;
+  switch (op) {
+  case TOKEN_ADD:
+    result->integer_value = (i64)(l + r);
+    break;
+  case TOKEN_SUB:
+    result->integer_value = (i64)(l - r);
+    break;
+  case TOKEN_MUL:
+    result->integer_value = (i64)(l * r);
+    break;
+  case TOKEN_QUO:
+  case TOKEN_MOD:
+    if (right->integer_value == 0 ||
+        (left->integer_value == INT64_MIN && right->integer_value == -1))
+      return FALSE;
+    result->integer_value = op == TOKEN_QUO
+                                ? left->integer_value / right->integer_value
+                                : left->integer_value % right->integer_value;
+    break;
+  default:
+    result->type = TOKEN_BOOL;
+    switch (op) {
+    case TOKEN_EQL:
+      result->integer_value = left->integer_value == right->integer_value;
+      break;
+    case TOKEN_NEQ:
+      result->integer_value = left->integer_value != right->integer_value;
+      break;
+    case TOKEN_LT:
+      result->integer_value = left->integer_value < right->integer_value;
+      break;
+    case TOKEN_GT:
+      result->integer_value = left->integer_value > right->integer_value;
+      break;
+    case TOKEN_LTE:
+      result->integer_value = left->integer_value <= right->integer_value;
+      break;
+    case TOKEN_GTE:
+      result->integer_value = left->integer_value >= right->integer_value;
+      break;
+    default:
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+// Evaluates a global's initializer at compile time.  Returns FALSE if it
+// depends on anything only known at runtime.
+static b8 eval_constant(c11_be_t *b, ast_node_t *node, c11_constant_t *result) {
+  switch (node->type) {
+  case ast_int_literal:
+    result->type = TOKEN_INT;
+    result->integer_value = node->literal.integer_value;
+    return TRUE;
+  case ast_bool_literal:
+    result->type = TOKEN_BOOL;
+    result->integer_value = node->literal.integer_value != 0;
+    return TRUE;
+  case ast_float_literal:
+    result->type = TOKEN_FLOAT;
+    result->float_value = node->literal.float_value;
+    return TRUE;
+  case ast_str_literal:
+    result->type = TOKEN_STR;
+    result->string_value = node->literal.string_value;
+    return TRUE;
+  case ast_symbol: {
+    str_entry_t *entry =
+        hashtbl_str_lookup(b->global_constants, cstr(node->symbol.value));
+    if (entry == NULL)
+      return FALSE;
+    c11_constant_t *value = entry->value;
+    // A dynamic initializer may have called code that assigned to it
+    if (!value->constant && b->dynamic_globals)
+      return FALSE;
+    *result = *value;
+    return TRUE;
+  }
+  case ast_expr: {
+    c11_constant_t left, right;
+    return eval_constant(b, node->expr.left, &left) &&
+           eval_constant(b, node->expr.right, &right) &&
+           eval_binary_op(node->expr.op, &left, &right, result);
+  }
+  case ast_term: {
+    c11_constant_t left, right;
+    return eval_constant(b, node->term.left, &left) &&
+           eval_constant(b, node->term.right, &right) &&
+           eval_binary_op(node->term.op, &left, &right, result);
+  }
+  default:
+    return FALSE;
+  }
+}
+
+static void build_constant(c11_be_t *b, e_token_type type,
+                           c11_constant_t *value) {
+  switch (type) {
+  case TOKEN_FLOAT:
+    str_builder_append(b->sb, constant_as_float(value));
+    break;
+  case TOKEN_BOOL:
+    str_builder_append(b->sb, value->integer_value ? "TRUE" : "FALSE");
+    break;
+  case TOKEN_STR:
+    str_builder_append(b->sb, "{.ptr = ");
+    build_c_string(b->sb, value->string_value, strlen(value->string_value));
+    str_builder_append(b->sb, ", .length = ");
+    str_builder_append(b->sb, (i64)strlen(value->string_value));
+    str_builder_append(b->sb, "}");
+    break;
+  default:
+    build_int_literal(b, value->type == TOKEN_FLOAT ? (i64)value->float_value
+                                                    : value->integer_value);
+  }
+}
+
+// Top level declarations are evaluated at compile time where possible, so
+// they're plain data in the binary with no startup cost.  Constants become
+// static const.  Initializers that need to run code are deferred to
+// I_init_globals, which main calls before anything else.
+static void build_global_decl(c11_be_t *b, ast_node_t *node) {
+  ASSERT_MSG((node->type == ast_decl), "Expected a decl node");
+  decl_t decl = node->decl;
+  c11_constant_t *value = imust_alloc(sizeof(c11_constant_t));
+  b8 folded = decl.expr && eval_constant(b, decl.expr, value) &&
+              (value->type == TOKEN_STR) == (decl.type == TOKEN_STR);
+  if (folded && decl.constant)
+    str_builder_append(b->sb, "static const ");
+  str_builder_append(b->sb, ika_type_to_c(decl.type));
+  str_builder_append(b->sb, " ");
+  str_builder_append(b->sb, decl.symbol->symbol.value);
+  if (folded) {
+    str_builder_append(b->sb, " = ");
+    build_constant(b, decl.type, value);
+    // Later initializers may refer to it, see eval_constant
+    value->constant = decl.constant;
+    hashtbl_str_insert(b->global_constants,
+                       (str_entry_t){.key = cstr(decl.symbol->symbol.value),
+                                     .valid = TRUE,
+                                     .value = value});
+  } else if (decl.expr) {
+    str_builder_t *code = b->sb;
+    b->sb = b->global_init;
+    str_builder_append(b->sb, "  ");
+    str_builder_append(b->sb, decl.symbol->symbol.value);
+    str_builder_append(b->sb, " = ");
+    build_expr(b, decl.expr);
+    str_builder_append(b->sb, ";\n");
+    b->sb = code;
+    b->dynamic_globals = TRUE;
+  }
+  str_builder_append(b->sb, ";\n");
+}
+
 static void add_indent(c11_be_t *b) {
   for (int i = 0; i < b->ident_level; i++)
     str_builder_append(b->sb, "  ");
 }
 
+// The fn node a call goes to
+static ast_node_t *callee_of(ast_node_t *call) {
+  symbol_table_entry_t *entry = call->fn_call.symbol->symbol.entry;
+  if (!entry || entry->type != TOKEN_KEYWORD_FN)
+    return NULL;
+  return entry->node_address;
+}
+
+// The call a return statement returns the result of, if it does
+static ast_node_t *tail_call_of(ast_node_t *return_statement) {
+  ast_node_t *expr = return_statement->returns.expr;
+  return expr && expr->type == ast_fn_call ? expr : NULL;
+}
+
+// Whether block, or a block nested in it, returns the result of calling fn
+static b8 has_self_tail_call(ast_node_t *fn, ast_node_t *block) {
+  ast_node_t *return_statement = block->block.return_statement;
+  ast_node_t *call = return_statement ? tail_call_of(return_statement) : NULL;
+  if (call && callee_of(call) == fn)
+    return TRUE;
+  for (int i = 0; i < small_vec_len(block->block.nodes); i++) {
+    ast_node_t *node = small_vec_get(block->block.nodes, i);
+    if (node->type == ast_block && has_self_tail_call(fn, node))
+      return TRUE;
+    if (node->type == ast_if_stmt &&
+        (has_self_tail_call(fn, node->if_stmt.if_block) ||
+         (node->if_stmt.else_block &&
+          has_self_tail_call(fn, node->if_stmt.else_block))))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// musttail needs the caller and callee to have the same signature, in C
+// types, and a value to return
+static b8 can_musttail(ast_node_t *caller, ast_node_t *callee) {
+  fn_t *from = &caller->fn, *to = &callee->fn;
+  if (from->return_type == TOKEN_VOID ||
+      strcmp(ika_type_to_c(from->return_type),
+             ika_type_to_c(to->return_type)) != 0 ||
+      small_vec_len(from->parameters) != small_vec_len(to->parameters))
+    return FALSE;
+  for (int i = 0; i < small_vec_len(from->parameters); i++) {
+    if (strcmp(ika_type_to_c(small_vec_get(from->parameters, i)->decl.type),
+               ika_type_to_c(small_vec_get(to->parameters, i)->decl.type)))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// A call to the function being built reassigns its parameters and jumps
+// back to the top, evaluating every argument before any is assigned.
+static void build_self_tail_call(c11_be_t *b, ast_node_t *call) {
+  fn_t *fn = &b->function->fn;
+  str_builder_append(b->sb, "{\n");
+  for (int i = 0; i < small_vec_len(fn->parameters); i++) {
+    add_indent(b);
+    str_builder_append(b->sb, "  ");
+    str_builder_append(
+        b->sb, ika_type_to_c(small_vec_get(fn->parameters, i)->decl.type));
+    str_builder_append(b->sb, " I_arg_");
+    str_builder_append(b->sb, (i64)i);
+    str_builder_append(b->sb, " = ");
+    build_expr(b, small_vec_get(call->fn_call.exprs, i));
+    str_builder_append(b->sb, ";\n");
+  }
+  for (int i = 0; i < small_vec_len(fn->parameters); i++) {
+    add_indent(b);
+    str_builder_append(b->sb, "  ");
+    str_builder_append(
+        b->sb, small_vec_get(fn->parameters, i)->decl.symbol->symbol.value);
+    str_builder_append(b->sb, " = I_arg_");
+    str_builder_append(b->sb, (i64)i);
+    str_builder_append(b->sb, ";\n");
+  }
+  add_indent(b);
+  str_builder_append(b->sb, "  goto I_tail_call;\n");
+  add_indent(b);
+  str_builder_append(b->sb, "}\n");
+}
+
+// Tail calls are made so they don't grow the C stack.  Self recursion
+// becomes a loop, other calls are marked musttail for compilers that
+// support it, when the signatures allow.
+static void build_return(c11_be_t *b, ast_node_t *node) {
+  ast_node_t *call = tail_call_of(node);
+  ast_node_t *callee = call ? callee_of(call) : NULL;
+  if (callee && callee == b->function) {
+    build_self_tail_call(b, call);
+    return;
+  }
+  if (callee && b->function && can_musttail(b->function, callee)) {
+    if (!b->musttail_defined) {
+      str_builder_append(b->literals, "#if defined(__has_attribute)\n"
+                                      "#if __has_attribute(musttail)\n"
+                                      "#define I_MUSTTAIL "
+                                      "__attribute__((musttail))\n"
+                                      "#endif\n"
+                                      "#endif\n"
+                                      "#ifndef I_MUSTTAIL\n"
+                                      "#define I_MUSTTAIL\n"
+                                      "#endif\n");
+      b->musttail_defined = TRUE;
+    }
+    str_builder_append(b->sb, "I_MUSTTAIL ");
+  }
+  str_builder_append(b->sb, "return");
+  if (node->returns.expr) {
+    str_builder_append(b->sb, " ");
+    build_expr(b, node->returns.expr);
+  }
+  str_builder_append(b->sb, ";\n");
+}
+
 static void build_block(c11_be_t *b, ast_node_t *node) {
   ASSERT_MSG((node->type == ast_block), "Expected a block node");
   block_t block = node->block;
   str_builder_append(b->sb, "{\n");
-  for (int i = 0; i < darray_len(block.nodes); i++) {
+  if (b->tail_loop && node == b->function->fn.block) {
+    add_indent(b);
+    str_builder_append(b->sb, "I_tail_call:;\n");
+  }
+  for (int i = 0; i < small_vec_len(block.nodes); i++) {
     add_indent(b);
-    build_node(b, &block.nodes[i]);
+    build_node(b, small_vec_get(block.nodes, i));
     str_builder_append(b->sb, "\n");
   }
   if (block.return_statement) {
     add_indent(b);
-    str_builder_append(b->sb, "return");
-    if (block.return_statement->returns.expr) {
-      str_builder_append(b->sb, " ");
-      build_expr(b, block.return_statement->returns.expr);
-    }
-    str_builder_append(b->sb, ";\n");
+    build_return(b, block.return_statement);
   }
   str_builder_append(b->sb, "}\n");
 }
@@ -138,26 +531,49 @@ static void build_function(c11_be_t *b, ast_node_t *node) {
   str_builder_append(b->sb, " I_");
   str_builder_append(b->sb, fn.symbol->symbol.value);
   str_builder_append(b->sb, "(");
-  for (int i = 0; i < darray_len(fn.parameters); i++) {
-    decl_t decl = fn.parameters[i].decl;
+  for (int i = 0; i < small_vec_len(fn.parameters); i++) {
+    decl_t decl = small_vec_get(fn.parameters, i)->decl;
     str_builder_append(b->sb, ika_type_to_c(decl.type));
     str_builder_append(b->sb, " ");
     str_builder_append(b->sb, decl.symbol->symbol.value);
-    if (i < darray_len(fn.parameters) - 1)
+    if (i < small_vec_len(fn.parameters) - 1)
       str_builder_append(b->sb, ", ");
   }
   str_builder_append(b->sb, ") ");
+  ast_node_t *function = b->function;
+  b8 tail_loop = b->tail_loop;
+  b->function = node;
+  b->tail_loop = has_self_tail_call(node, fn.block);
   b->ident_level++;
   build_block(b, fn.block);
   b->ident_level--;
+  b->function = function;
+  b->tail_loop = tail_loop;
   str_builder_append(b->sb, "\n");
 }
 
+// Calls the runtime's print for the type the typechecker resolved, rather
+// than leaving the print macro to pick one from the C type.  A comparison is
+// an int in C, which the macro has no case for.
 static void build_print(c11_be_t *b, ast_node_t *node) {
   ASSERT_MSG((node->type == ast_print_stmt), "Expected a print_stmt node");
   print_t prt = node->print_stmt;
-  // TODO: Add support for types besides string
-  str_builder_append(b->sb, "print(");
+  switch (prt.expr->resolved_type) {
+  case TOKEN_INT:
+    str_builder_append(b->sb, "_ika_print_int(");
+    break;
+  case TOKEN_FLOAT:
+    str_builder_append(b->sb, "_ika_print_float(");
+    break;
+  case TOKEN_BOOL:
+    str_builder_append(b->sb, "_ika_print_bool(");
+    break;
+  case TOKEN_STR:
+    str_builder_append(b->sb, "_ika_print_str(");
+    break;
+  default:
+    ASSERT_MSG((FALSE), "Print of an expression without a resolved type");
+  }
   build_expr(b, prt.expr);
   str_builder_append(b->sb, ");");
 }
@@ -205,7 +621,14 @@ static void build_node(c11_be_t *b, ast_node_t *node) {
 }
 
 static void build_entry_point(c11_be_t *b) {
+  if (b->dynamic_globals) {
+    str_builder_append(b->sb, "\nstatic void I_init_globals(void) {\n");
+    str_builder_append(b->sb, str_builder_view(b->global_init));
+    str_builder_append(b->sb, "}\n");
+  }
   str_builder_append(b->sb, "\nint main(int argc, char **argv) {\n");
+  if (b->dynamic_globals)
+    str_builder_append(b->sb, "  I_init_globals();\n");
   str_builder_append(b->sb, "  I_main();\n}\n");
 }
 
@@ -235,18 +658,61 @@ static char *get_c_filename(c11_be_t *b) {
   }
 }
 
+// Hands what has been built so far to the output file, the builder only ever
+// holds one top level node at a time.  Any literals it introduced are
+// defined first.
+static b8 flush_output(c11_be_t *b) {
+  str literals = str_builder_view(b->literals);
+  b8 result =
+      file_sink_write(&b->sink, str_ptr(&literals), str_len(literals));
+  str_builder_clear(b->literals);
+  str pending = str_builder_view(b->sb);
+  result = file_sink_write(&b->sink, str_ptr(&pending), str_len(pending)) &&
+           result;
+  str_builder_clear(b->sb);
+  return result;
+}
+
 b8 c11_generate(compilation_unit_t *unit) {
   printf("Generating C code\n");
   str_builder_t *builder = str_builder_init();
-  c11_be_t b = {.sb = builder, .ident_level = 0, .filename = unit->src_file};
+  c11_be_t b = {.sb = builder,
+                .literals = str_builder_init(),
+                .literal_ids = hashtbl_str_init(),
+                .global_constants = hashtbl_str_init(),
+                .global_init = str_builder_init(),
+                .ident_level = 0,
+                .filename = unit->src_file};
+  char *c_filename = get_c_filename(&b);
+#ifdef C11_MAP_OUTPUT
+  b8 mapped = TRUE;
+#else
+  b8 mapped = FALSE;
+#endif
+  if (!file_sink_open(&b.sink, c_filename, mapped)) {
+    ERROR("Couldn't open %s for writing\n", c_filename);
+    str_builder_cleanup(builder);
+    str_builder_cleanup(b.literals);
+    str_builder_cleanup(b.global_init);
+    return FALSE;
+  }
   add_includes(&b);
-  for (u64 i = 0; i < darray_len(unit->root->block.nodes); i++) {
-    build_node(&b, &unit->root->block.nodes[i]);
+  b8 result = flush_output(&b);
+  for (u64 i = 0; i < small_vec_len(unit->root->block.nodes); i++) {
+    ast_node_t *node = small_vec_get(unit->root->block.nodes, i);
+    if (node->type == ast_decl)
+      build_global_decl(&b, node);
+    else
+      build_node(&b, node);
+    result = flush_output(&b) && result;
   }
   build_entry_point(&b);
-  str c_code = str_builder_to_alloced_str(builder);
+  result = flush_output(&b) && result;
+  result = file_sink_close(&b.sink) && result;
   str_builder_cleanup(builder);
-  FILE *c_output = fopen(get_c_filename(&b), "w");
-  fprintf(c_output, "%s", str_to_cstr(c_code));
-  return TRUE;
+  str_builder_cleanup(b.literals);
+  str_builder_cleanup(b.global_init);
+  if (!result)
+    ERROR("Failed writing generated C to %s\n", c_filename);
+  return result;
 }
@@ -1,10 +1,50 @@
 #pragma once
 
+#include "../../lib/file_sink.h"
+#include "../../lib/hashtbl.h"
 #include "../compiler.h"
 #include "../rt/str_builder.h"
 
+// Write the generated C through an mmap'd view of the output file rather than
+// with write(2).  Comment out to disable
+// #define C11_MAP_OUTPUT
+
+// A global's initializer worked out at compile time, type is TOKEN_INT,
+// TOKEN_FLOAT, TOKEN_BOOL or TOKEN_STR.  constant is set if the global is
+// declared constant.
+typedef struct c11_constant_t {
+  e_token_type type;
+  b8 constant;
+  union {
+    i64 integer_value;
+    f64 float_value;
+    const char *string_value;
+  };
+} c11_constant_t;
+
 typedef struct c11_be_t {
   str_builder_t *sb;
+  file_sink_t sink;
+  // String literals become static const str constants, each distinct literal
+  // is emitted once.  Definitions for literals first seen in the current top
+  // level node wait in literals and are written out ahead of it, as does the
+  // I_MUSTTAIL macro the first time a tail call needs it.
+  str_builder_t *literals;
+  hashtbl_str_t *literal_ids;
+  u32 literal_count;
+  b8 musttail_defined;
+  // The function being built.  A function that calls itself in tail
+  // position gets a label at the top of its body, and those calls jump back
+  // to it.
+  ast_node_t *function;
+  b8 tail_loop;
+  // Globals whose initializers could be evaluated at compile time, by name.
+  // Anything else is assigned in the generated I_init_globals function, once
+  // one of those has been seen mutable globals may have changed by the time
+  // a later initializer runs and are no longer folded into it.
+  hashtbl_str_t *global_constants;
+  str_builder_t *global_init;
+  b8 dynamic_globals;
   u32 ident_level;
   char *filename;
 } c11_be_t;
@@ -137,8 +137,8 @@ static void build_expression(symbol_table_t *st, ast_node_t *node) {
 b8 qbe_generate(compilation_unit_t *unit) {
   printf("Generating code for qbe backend\n");
   symbol_table_t *myst = unit->root->block.symbol_table;
-  for (int i = 0; i < darray_len(unit->root->block.nodes); i++) {
-    ast_node_t *child = &unit->root->block.nodes[i];
+  for (int i = 0; i < small_vec_len(unit->root->block.nodes); i++) {
+    ast_node_t *child = small_vec_get(unit->root->block.nodes, i);
     printf("Child node is: %d\n", child->type);
     if (child->type == ast_decl) {
       build_expression(myst, child->decl.expr);
@@ -0,0 +1,595 @@
+#include <stdarg.h>
+#include <string.h>
+
+#include "../lib/allocator.h"
+#include "../lib/assert.h"
+
+#include "bytecode.h"
+#include "rt/darray.h"
+
+void bytecode_builder_init(bytecode_builder_t *b) {
+  b->da_code = darray_init(u8);
+  b->da_constants = darray_init(ika_value);
+}
+
+u32 bytecode_position(bytecode_builder_t *b) {
+  return (u32)darray_len(b->da_code);
+}
+
+// Whether an instruction ends in a jump target, and whether execution can
+// carry on to the instruction after it.
+static b8 has_target(u8 opcode) {
+  return opcode == JUMP || opcode == JUMP_IF_FALSE ||
+         opcode == LT_I64_JUMP_IF_FALSE || opcode == ADD_I64_JUMP;
+}
+
+static b8 falls_through(u8 opcode) {
+  return opcode != JUMP && opcode != ADD_I64_JUMP && opcode != TAIL_CALL &&
+         opcode != RETURN && opcode != EOP;
+}
+
+static void bytecode_emit_operand(bytecode_builder_t *b, u32 operand) {
+  u8 bytes[5];
+  u32 count = 0;
+  do {
+    bytes[count] = operand & 0x7F;
+    operand >>= 7;
+    if (operand)
+      bytes[count] |= 0x80;
+    count++;
+  } while (operand);
+  darray_append_n(b->da_code, bytes, count);
+}
+
+void bytecode_emit(bytecode_builder_t *b, u8 opcode, u32 operand_count, ...) {
+  ASSERT_MSG((!has_target(opcode)), "Use bytecode_emit_jump for jumps");
+  darray_append(b->da_code, opcode);
+  va_list operands;
+  va_start(operands, operand_count);
+  for (u32 i = 0; i < operand_count; i++)
+    bytecode_emit_operand(b, va_arg(operands, u32));
+  va_end(operands);
+}
+
+u32 bytecode_emit_jump(bytecode_builder_t *b, u8 opcode, u32 condition,
+                       u32 target) {
+  ASSERT_MSG((opcode == JUMP || opcode == JUMP_IF_FALSE), "Expected a jump");
+  darray_append(b->da_code, opcode);
+  if (opcode == JUMP_IF_FALSE)
+    bytecode_emit_operand(b, condition);
+  u32 at = bytecode_position(b);
+  darray_append_n(b->da_code, &target, sizeof(target));
+  return at;
+}
+
+void bytecode_patch_jump(bytecode_builder_t *b, u32 at, u32 target) {
+  memcpy(&b->da_code[at], &target, sizeof(target));
+}
+
+u32 bytecode_constant(bytecode_builder_t *b, ika_value value) {
+  // Pools are small, a linear search is fine.  Values are compared by their
+  // bits so 0.0 and -0.0 stay distinct.
+  for (u32 i = 0; i < darray_len(b->da_constants); i++) {
+    if (b->da_constants[i].type == value.type &&
+        b->da_constants[i].value == value.value)
+      return i;
+  }
+  darray_append(b->da_constants, value);
+  return (u32)darray_len(b->da_constants) - 1;
+}
+
+const u8 *bytecode_read_long_operand(const u8 *ip, u32 *value) {
+  *value &= 0x7F;
+  u32 shift = 7;
+  u8 byte;
+  do {
+    byte = *ip++;
+    *value |= (u32)(byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return ip;
+}
+
+vm_function_t bytecode_finish(bytecode_builder_t *b, const char *name,
+                              u32 parameter_count,
+                              e_ika_vm_type *parameter_types,
+                              e_ika_vm_type return_type, u32 register_count) {
+  return (vm_function_t){.name = name,
+                         .code = b->da_code,
+                         .code_size = bytecode_position(b),
+                         .constants = b->da_constants,
+                         .constant_count = (u32)darray_len(b->da_constants),
+                         .parameter_count = parameter_count,
+                         .parameter_types = parameter_types,
+                         .return_type = return_type,
+                         .register_count = register_count};
+}
+
+e_ika_vm_type bytecode_value_type(e_token_type type) {
+  switch (type) {
+  case TOKEN_INT:
+  case TOKEN_BOOL:
+    return IKA_INT;
+  case TOKEN_FLOAT:
+    return IKA_FLOAT;
+  case TOKEN_STR:
+    return IKA_STR;
+  default:
+    return IKA_NONE;
+  }
+}
+
+u8 bytecode_binary_opcode(e_token_type op, e_ika_vm_type operand_type) {
+  if (operand_type == IKA_INT) {
+    switch (op) {
+    case TOKEN_ADD:
+      return ADD_I64;
+    case TOKEN_SUB:
+      return SUB_I64;
+    case TOKEN_MUL:
+      return MUL_I64;
+    case TOKEN_QUO:
+      return DIV_I64;
+    case TOKEN_MOD:
+      return MOD_I64;
+    case TOKEN_EQL:
+      return EQ_I64;
+    case TOKEN_NEQ:
+      return NE_I64;
+    case TOKEN_GT:
+      return GT_I64;
+    case TOKEN_GTE:
+      return GTE_I64;
+    case TOKEN_LT:
+      return LT_I64;
+    case TOKEN_LTE:
+      return LTE_I64;
+    default:
+      return OPCODE_COUNT;
+    }
+  }
+  if (operand_type == IKA_FLOAT) {
+    switch (op) {
+    case TOKEN_ADD:
+      return ADD_F64;
+    case TOKEN_SUB:
+      return SUB_F64;
+    case TOKEN_MUL:
+      return MUL_F64;
+    case TOKEN_QUO:
+      return DIV_F64;
+    case TOKEN_EQL:
+      return EQ_F64;
+    case TOKEN_NEQ:
+      return NE_F64;
+    case TOKEN_GT:
+      return GT_F64;
+    case TOKEN_GTE:
+      return GTE_F64;
+    case TOKEN_LT:
+      return LT_F64;
+    case TOKEN_LTE:
+      return LTE_F64;
+    default:
+      return OPCODE_COUNT;
+    }
+  }
+  return OPCODE_COUNT;
+}
+
+// Verification
+//
+// A first pass decodes every instruction, bounds checking as it goes, and
+// marks where instructions start.  A second pass walks the control flow
+// tracking the type each register holds, merging the states that meet at
+// jump targets.  A register that holds different types on different paths
+// into a target, or nothing at all, can't be read there.
+
+typedef struct instruction_t {
+  u8 opcode;
+  u32 operands[4];
+  u32 target;
+  // Offset of the next instruction
+  u32 next;
+} instruction_t;
+
+#define INSTRUCTION_START 1
+#define INSTRUCTION_JUMP_TARGET 2
+
+static u32 operand_count(u8 opcode) {
+  switch (opcode) {
+  case JUMP:
+  case EOP:
+    return 0;
+  case JUMP_IF_FALSE:
+  case PRINT:
+  case RETURN:
+    return 1;
+  case I64_TO_F64:
+  case MOV:
+  case LOAD:
+    return 2;
+  case CALL:
+  case LOAD_ADD_I64:
+  case LOAD_SUB_I64:
+    return 4;
+  default:
+    return 3;
+  }
+}
+
+static const char *decode(vm_function_t *fn, u32 at, instruction_t *out) {
+  const u8 *code = fn->code;
+  out->opcode = code[at++];
+  if (out->opcode >= OPCODE_COUNT)
+    return "Unknown opcode";
+  for (u32 i = 0; i < operand_count(out->opcode); i++) {
+    u32 value = 0;
+    u32 shift = 0;
+    u8 byte;
+    do {
+      if (at == fn->code_size)
+        return "Instruction runs past the end of the function";
+      if (shift > 28)
+        return "Operand too large";
+      byte = code[at++];
+      value |= (u32)(byte & 0x7F) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    out->operands[i] = value;
+  }
+  if (has_target(out->opcode)) {
+    if (fn->code_size - at < sizeof(out->target))
+      return "Instruction runs past the end of the function";
+    memcpy(&out->target, &code[at], sizeof(out->target));
+    at += sizeof(out->target);
+  }
+  out->next = at;
+  return NULL;
+}
+
+// Whether operand i names a register, rather than a constant, function or
+// count.
+static b8 is_register(u8 opcode, u32 i) {
+  switch (opcode) {
+  case LOAD:
+  case LOAD_ADD_I64:
+  case LOAD_SUB_I64:
+    return i != 1;
+  case CALL:
+    return i == 0;
+  case TAIL_CALL:
+    return FALSE;
+  default:
+    return TRUE;
+  }
+}
+
+static const char *check_instruction(vm_program_t *program, vm_function_t *fn,
+                                     instruction_t *ins) {
+  u32 *operands = ins->operands;
+  for (u32 i = 0; i < operand_count(ins->opcode); i++) {
+    if (is_register(ins->opcode, i) && operands[i] >= fn->register_count)
+      return "Register out of range";
+  }
+  switch (ins->opcode) {
+  case LOAD:
+  case LOAD_ADD_I64:
+  case LOAD_SUB_I64:
+    if (operands[1] >= fn->constant_count)
+      return "Constant out of range";
+    break;
+  case CALL:
+  case TAIL_CALL: {
+    // function, first_arg and arg_count, after CALL's destination
+    u32 *call = ins->opcode == CALL ? operands + 1 : operands;
+    if (call[0] >= program->function_count)
+      return "Unknown function";
+    vm_function_t *callee = &program->functions[call[0]];
+    if (call[2] != callee->parameter_count)
+      return "Wrong number of arguments";
+    if (call[1] > fn->register_count ||
+        call[2] > fn->register_count - call[1])
+      return "Arguments out of range";
+    break;
+  }
+  }
+  if (has_target(ins->opcode) && ins->target >= fn->code_size)
+    return "Jump out of range";
+  return NULL;
+}
+
+// Merges state into the one recorded at a jump target, returning whether the
+// target's state changed and needs walking (again).
+static b8 merge_state(u8 **states, u32 at, u8 *state, u32 register_count) {
+  if (!states[at]) {
+    states[at] = imust_alloc(register_count);
+    memcpy(states[at], state, register_count);
+    return TRUE;
+  }
+  b8 changed = FALSE;
+  for (u32 i = 0; i < register_count; i++) {
+    if (states[at][i] != state[i] && states[at][i] != IKA_NONE) {
+      states[at][i] = IKA_NONE;
+      changed = TRUE;
+    }
+  }
+  return changed;
+}
+
+// Applies one instruction to the register types in state
+static const char *check_types(vm_program_t *program, vm_function_t *fn,
+                               instruction_t *ins, u8 *state) {
+  u32 *operands = ins->operands;
+  u8 opcode = ins->opcode;
+  if (opcode <= MOD_I64 || (opcode >= EQ_I64 && opcode <= LTE_I64) ||
+      opcode == LT_I64_JUMP_IF_FALSE || opcode == ADD_I64_JUMP) {
+    if (state[operands[1]] != IKA_INT || state[operands[2]] != IKA_INT)
+      return "Expected int operands";
+    state[operands[0]] = IKA_INT;
+    return NULL;
+  }
+  if (opcode <= DIV_F64 || (opcode >= EQ_F64 && opcode <= LTE_F64)) {
+    if (state[operands[1]] != IKA_FLOAT || state[operands[2]] != IKA_FLOAT)
+      return "Expected float operands";
+    state[operands[0]] = opcode <= DIV_F64 ? IKA_FLOAT : IKA_INT;
+    return NULL;
+  }
+  switch (opcode) {
+  case I64_TO_F64:
+    if (state[operands[1]] != IKA_INT)
+      return "Expected an int operand";
+    state[operands[0]] = IKA_FLOAT;
+    break;
+  case MOV:
+    if (state[operands[1]] == IKA_NONE)
+      return "Register read before it's written";
+    state[operands[0]] = state[operands[1]];
+    break;
+  case LOAD:
+    state[operands[0]] = fn->constants[operands[1]].type;
+    break;
+  case LOAD_ADD_I64:
+  case LOAD_SUB_I64:
+    state[operands[0]] = fn->constants[operands[1]].type;
+    if (state[operands[0]] != IKA_INT || state[operands[3]] != IKA_INT)
+      return "Expected int operands";
+    state[operands[2]] = IKA_INT;
+    break;
+  case JUMP_IF_FALSE:
+    if (state[operands[0]] != IKA_INT)
+      return "Expected an int condition";
+    break;
+  case CALL:
+  case TAIL_CALL: {
+    u32 *call = opcode == CALL ? operands + 1 : operands;
+    vm_function_t *callee = &program->functions[call[0]];
+    for (u32 i = 0; i < call[2]; i++) {
+      if (state[call[1] + i] != callee->parameter_types[i])
+        return "Argument of the wrong type";
+    }
+    if (opcode == CALL)
+      state[operands[0]] = callee->return_type;
+    else if (callee->return_type != fn->return_type)
+      return "Tail call returns a value of the wrong type";
+    break;
+  }
+  case PRINT:
+    if (state[operands[0]] == IKA_NONE)
+      return "Register read before it's written";
+    break;
+  case RETURN:
+    if (fn->return_type == IKA_NONE ||
+        state[operands[0]] != fn->return_type)
+      return "Returned value of the wrong type";
+    break;
+  case EOP:
+    if (fn->return_type != IKA_NONE)
+      return "Missing return value";
+    break;
+  }
+  return NULL;
+}
+
+// Decodes every instruction, marking in flags where each starts and which
+// are jumped to.
+static const char *check_layout(vm_program_t *program, vm_function_t *fn,
+                                u8 *flags, u32 *offset) {
+  const char *error;
+  instruction_t ins;
+  for (u32 at = 0; at < fn->code_size; at = ins.next) {
+    *offset = at;
+    flags[at] |= INSTRUCTION_START;
+    if ((error = decode(fn, at, &ins)) ||
+        (error = check_instruction(program, fn, &ins)))
+      return error;
+    if (has_target(ins.opcode))
+      flags[ins.target] |= INSTRUCTION_JUMP_TARGET;
+    if (ins.next == fn->code_size && falls_through(ins.opcode))
+      return "Execution runs off the end of the function";
+  }
+  for (u32 at = 0; at < fn->code_size; at = ins.next) {
+    *offset = at;
+    decode(fn, at, &ins);
+    if (has_target(ins.opcode) && !(flags[ins.target] & INSTRUCTION_START))
+      return "Jump into the middle of an instruction";
+  }
+  return NULL;
+}
+
+// Walks the control flow from the entry point.  Only the states at jump
+// targets are kept, straight line code is walked with a scratch copy.
+static const char *check_flow(vm_program_t *program, vm_function_t *fn,
+                              u8 *flags, u32 *offset) {
+  const char *error = NULL;
+  u32 register_count = fn->register_count;
+  u8 **states = imust_alloc(sizeof(u8 *) * fn->code_size);
+  u8 *state = imust_alloc(register_count);
+  u32 *da_pending = darray_init(u32);
+  for (u32 i = 0; i < fn->parameter_count; i++)
+    state[i] = fn->parameter_types[i];
+  u32 at = 0;
+  for (;;) {
+    instruction_t ins;
+    *offset = at;
+    decode(fn, at, &ins);
+    if ((error = check_types(program, fn, &ins, state)))
+      break;
+    b8 continues = falls_through(ins.opcode);
+    if (has_target(ins.opcode) &&
+        merge_state(states, ins.target, state, register_count))
+      darray_append(da_pending, ins.target);
+    if (continues && !(flags[ins.next] & INSTRUCTION_JUMP_TARGET)) {
+      at = ins.next;
+      continue;
+    }
+    if (continues && merge_state(states, ins.next, state, register_count))
+      darray_append(da_pending, ins.next);
+    if (darray_len(da_pending) == 0)
+      break;
+    darray_pop(da_pending, &at);
+    memcpy(state, states[at], register_count);
+  }
+  for (u32 i = 0; i < fn->code_size; i++) {
+    if (states[i])
+      ifree(states[i]);
+  }
+  ifree(states);
+  ifree(state);
+  darray_deinit(da_pending);
+  return error;
+}
+
+static const char *verify_function(vm_program_t *program, vm_function_t *fn,
+                                   u32 *offset) {
+  *offset = 0;
+  if (fn->code_size == 0)
+    return "Empty function";
+  if (fn->parameter_count > fn->register_count)
+    return "More parameters than registers";
+  for (u32 i = 0; i < fn->parameter_count; i++) {
+    if (fn->parameter_types[i] == IKA_NONE)
+      return "Parameter without a type";
+  }
+  for (u32 i = 0; i < fn->constant_count; i++) {
+    e_ika_vm_type type = fn->constants[i].type;
+    if (type != IKA_INT && type != IKA_FLOAT && type != IKA_STR)
+      return "Constant without a type";
+  }
+  u8 *flags = imust_alloc(fn->code_size);
+  const char *error = check_layout(program, fn, flags, offset);
+  if (!error)
+    error = check_flow(program, fn, flags, offset);
+  ifree(flags);
+  return error;
+}
+
+const char *bytecode_verify(vm_program_t *program, u32 *function,
+                            u32 *offset) {
+  for (*function = 0; *function < program->function_count; (*function)++) {
+    const char *error =
+        verify_function(program, &program->functions[*function], offset);
+    if (error)
+      return error;
+  }
+  return NULL;
+}
+
+// Superinstructions
+//
+// The pairs fused are the most frequent ones in vm_bench's programs: the
+// test and branch at the top of a loop, the increment and jump back at the
+// bottom, and a constant loaded just to be added or subtracted.  A pair is
+// only fused when nothing jumps to its second half.
+
+static u8 fused_opcode(instruction_t *first, instruction_t *second) {
+  switch (first->opcode) {
+  case LT_I64:
+    if (second->opcode == JUMP_IF_FALSE &&
+        second->operands[0] == first->operands[0])
+      return LT_I64_JUMP_IF_FALSE;
+    break;
+  case ADD_I64:
+    if (second->opcode == JUMP)
+      return ADD_I64_JUMP;
+    break;
+  case LOAD:
+    if (second->opcode == ADD_I64 && second->operands[2] == first->operands[0])
+      return LOAD_ADD_I64;
+    if (second->opcode == SUB_I64 && second->operands[2] == first->operands[0])
+      return LOAD_SUB_I64;
+    break;
+  }
+  return OPCODE_COUNT;
+}
+
+static void emit_instruction(bytecode_builder_t *b, instruction_t *ins) {
+  darray_append(b->da_code, ins->opcode);
+  for (u32 i = 0; i < operand_count(ins->opcode); i++)
+    bytecode_emit_operand(b, ins->operands[i]);
+  if (has_target(ins->opcode))
+    darray_append_n(b->da_code, &ins->target, sizeof(ins->target));
+}
+
+void bytecode_fuse(vm_function_t *fn) {
+  u8 *flags = imust_alloc(fn->code_size);
+  instruction_t ins;
+  for (u32 at = 0; at < fn->code_size; at = ins.next) {
+    decode(fn, at, &ins);
+    if (has_target(ins.opcode))
+      flags[ins.target] |= INSTRUCTION_JUMP_TARGET;
+  }
+
+  // Targets are copied as they are and fixed up once every instruction's
+  // new offset is known.
+  u32 *new_offsets = imust_alloc(sizeof(u32) * fn->code_size);
+  u32 *da_targets = darray_init(u32);
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  b8 changed = FALSE;
+  for (u32 at = 0; at < fn->code_size; at = ins.next) {
+    decode(fn, at, &ins);
+    new_offsets[at] = bytecode_position(&b);
+    instruction_t second;
+    u8 fused = OPCODE_COUNT;
+    if (ins.next < fn->code_size &&
+        !(flags[ins.next] & INSTRUCTION_JUMP_TARGET)) {
+      decode(fn, ins.next, &second);
+      fused = fused_opcode(&ins, &second);
+    }
+    instruction_t out = ins;
+    if (fused != OPCODE_COUNT) {
+      out.opcode = fused;
+      if (fused == LOAD_ADD_I64 || fused == LOAD_SUB_I64) {
+        out.operands[2] = second.operands[0];
+        out.operands[3] = second.operands[1];
+      } else {
+        out.target = second.target;
+      }
+      ins.next = second.next;
+      changed = TRUE;
+    }
+    emit_instruction(&b, &out);
+    if (has_target(out.opcode))
+      darray_append(da_targets, bytecode_position(&b) - sizeof(out.target));
+  }
+  // Fusing is greedy from the front, so a pair left unfused was looked at
+  // and turned down.  Running it again over its own output finds nothing.
+  if (changed) {
+    for (u32 i = 0; i < darray_len(da_targets); i++) {
+      u32 target;
+      memcpy(&target, &b.da_code[da_targets[i]], sizeof(target));
+      bytecode_patch_jump(&b, da_targets[i], new_offsets[target]);
+    }
+    darray_deinit(fn->code);
+    fn->code = b.da_code;
+    fn->code_size = bytecode_position(&b);
+  } else {
+    darray_deinit(b.da_code);
+  }
+
+  darray_deinit(b.da_constants);
+  darray_deinit(da_targets);
+  ifree(new_offsets);
+  ifree(flags);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string.h>
+
+#include "defines.h"
+#include "tokens.h"
+#include "vm.h"
+
+// Bytecode encoding
+//
+// Every instruction is a one byte opcode followed by its operands.  Register
+// numbers, constant pool indexes, function indexes and counts are unsigned
+// LEB128, so the common case of a value below 128 takes a single byte.  Jump
+// targets are a fixed four bytes (native byte order) holding the byte offset
+// of the target within the function, which lets them be patched after the
+// fact.
+
+// Builds the code and constant pool of one vm function.
+typedef struct bytecode_builder_t {
+  u8 *da_code;
+  ika_value *da_constants;
+} bytecode_builder_t;
+
+void bytecode_builder_init(bytecode_builder_t *);
+
+// Offset of the next instruction, to use as a jump target
+u32 bytecode_position(bytecode_builder_t *);
+
+// Emits an instruction without a jump target, followed by operand_count u32
+// operands.
+void bytecode_emit(bytecode_builder_t *, u8 opcode, u32 operand_count, ...);
+
+// Emits JUMP (the condition is ignored) or JUMP_IF_FALSE.  Returns where the
+// target was written so it can be filled in with bytecode_patch_jump once
+// it's known.
+u32 bytecode_emit_jump(bytecode_builder_t *, u8 opcode, u32 condition,
+                       u32 target);
+void bytecode_patch_jump(bytecode_builder_t *, u32 at, u32 target);
+
+// Returns the constant pool index of value, adding it if it isn't there yet.
+u32 bytecode_constant(bytecode_builder_t *, ika_value value);
+
+// Hands the code and constants over to a function, the builder is done with.
+vm_function_t bytecode_finish(bytecode_builder_t *, const char *name,
+                              u32 parameter_count,
+                              e_ika_vm_type *parameter_types,
+                              e_ika_vm_type return_type, u32 register_count);
+
+// The register type holding values of a typechecked type, IKA_NONE for void
+// and types the vm can't represent.
+e_ika_vm_type bytecode_value_type(e_token_type type);
+
+// The opcode for a binary operator on operands of the given type, or
+// OPCODE_COUNT if the vm has no such operation.
+u8 bytecode_binary_opcode(e_token_type op, e_ika_vm_type operand_type);
+
+// Checks every function in program decodes cleanly, stays within its
+// registers, constants and code, and only hands instructions operands of
+// the type they expect.  Returns NULL if it does, otherwise what's wrong and
+// the function and byte offset of the offending instruction.
+const char *bytecode_verify(vm_program_t *, u32 *function, u32 *offset);
+
+// Decodes the rest of an operand that didn't fit in its first byte and
+// returns where the next one starts.  Kept out of line, and away from the
+// caller's instruction pointer, so the single byte case inlines to a load
+// and a test.
+const u8 *bytecode_read_long_operand(const u8 *ip, u32 *value);
+
+static inline u32 bytecode_read_operand(const u8 **ip) {
+  u32 value = *(*ip)++;
+  if (value >= 0x80)
+    *ip = bytecode_read_long_operand(*ip, &value);
+  return value;
+}
+
+static inline u32 bytecode_read_target(const u8 **ip) {
+  u32 target;
+  memcpy(&target, *ip, sizeof(target));
+  *ip += sizeof(target);
+  return target;
+}
+
+// Rewrites a verified function's code, fusing common instruction pairs into
+// the superinstructions described in vm.h.  Code with nothing left to fuse
+// is left as it is, so loading a program again (as comptime does after each
+// function it adds) costs a scan rather than a copy.
+void bytecode_fuse(vm_function_t *);
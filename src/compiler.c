@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -22,6 +23,17 @@ typedef struct timings {
   u64 analyzation;
 } timings;
 
+// Bytes handed out by the allocator during each pass
+typedef struct allocations {
+  u64 tokenization;
+  u64 parsing;
+  u64 analyzation;
+  u64 generation;
+} allocations;
+
+// Number of allocation call sites listed by -stats
+#define STATS_TOP_CALL_SITES 10
+
 static u64 time_in_ms() {
   struct timespec now;
   timespec_get(&now, TIME_UTC);
@@ -29,7 +41,7 @@ static u64 time_in_ms() {
 }
 
 compilation_unit_t *new_compilation_unit(char *filename, u64 file_length,
-                                         b8 verbose) {
+                                         b8 verbose, b8 stats) {
   // Allocate all the memory for loading the file, add a byte to the end
   // for the trailing zero.
   char *buffer = imust_alloc(file_length + 1);
@@ -51,6 +63,7 @@ compilation_unit_t *new_compilation_unit(char *filename, u64 file_length,
   compilation_unit_t *unit = imust_alloc(sizeof(compilation_unit_t));
   unit->src_file = filename;
   unit->verbose = verbose;
+  unit->stats = stats;
   unit->buffer = buffer;
   unit->buffer_length = read;
   unit->current_token_idx = 0;
@@ -60,12 +73,15 @@ compilation_unit_t *new_compilation_unit(char *filename, u64 file_length,
 
 void compile(compilation_unit_t *unit) {
   timings timer = {0};
+  allocations allocated = {0};
   u64 start = time_in_ms();
+  u64 used = allocator_bytes_used();
   if (unit->verbose)
     printf("\n-------------------------------------\nTokenization pass\n");
   da_tokens *tokens =
       tokenizer_scan(unit->buffer, unit->buffer_length, unit->errors);
   timer.tokenization = time_in_ms() - start;
+  allocated.tokenization = allocator_bytes_used() - used;
 
   if (unit->verbose) {
     /* Print tokens */
@@ -76,17 +92,21 @@ void compile(compilation_unit_t *unit) {
   }
 
   start = time_in_ms();
+  used = allocator_bytes_used();
   if (unit->verbose)
     printf("\n-------------------------------------\nParser pass\n");
   ast_node_t *root = parser_parse(tokens, unit->errors);
   timer.parsing = time_in_ms() - start;
+  allocated.parsing = allocator_bytes_used() - used;
   unit->root = root;
 
   start = time_in_ms();
+  used = allocator_bytes_used();
   if (unit->verbose)
     printf("\n-------------------------------------\nTyping pass\n");
   tc_check(unit);
   timer.analyzation = time_in_ms() - start;
+  allocated.analyzation = allocator_bytes_used() - used;
 
   if (darray_len(unit->errors) > 0) {
     errors_display_parser_errors(unit->errors, unit->buffer);
@@ -97,11 +117,25 @@ void compile(compilation_unit_t *unit) {
       print_symbol_table(root->block.symbol_table);
     }
     unit->root = root;
+    used = allocator_bytes_used();
     c11_generate(unit);
+    allocated.generation = allocator_bytes_used() - used;
     printf("\nTimings:\n");
     printf("Tokenization took: %li ms\n", timer.tokenization);
     printf("Parsing took: %li ms\n", timer.parsing);
     printf("Analyzation took: %li ms\n", timer.analyzation);
     printf("Compilation complete for: %s\n", unit->src_file);
   }
+
+  if (unit->stats) {
+    printf("\nMemory:\n");
+    printf("Tokenization allocated: %" PRIu64 " bytes\n",
+           allocated.tokenization);
+    printf("Parsing allocated: %" PRIu64 " bytes\n", allocated.parsing);
+    printf("Analyzation allocated: %" PRIu64 " bytes\n",
+           allocated.analyzation);
+    printf("Code generation allocated: %" PRIu64 " bytes\n",
+           allocated.generation);
+    allocator_print_stats(stdout, STATS_TOP_CALL_SITES);
+  }
 }
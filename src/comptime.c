@@ -0,0 +1,461 @@
+#include <math.h>
+#include <string.h>
+
+#include "../lib/allocator.h"
+#include "../lib/assert.h"
+
+#include "bytecode.h"
+#include "comptime.h"
+#include "rt/darray.h"
+
+typedef struct local_t {
+  char *name;
+  u32 reg;
+  e_token_type type;
+} local_t;
+
+// State while lowering one function.  Registers below next_register hold
+// locals or temporaries still in use, temporaries are released at the end
+// of the statement that made them.
+typedef struct lower_t {
+  comptime_t *comptime;
+  bytecode_builder_t b;
+  // Locals in scope, innermost last
+  local_t *da_locals;
+  u32 next_register;
+  u32 register_count;
+  e_token_type return_type;
+} lower_t;
+
+static b8 lower_expr(lower_t *, ast_node_t *, u32 *reg, e_token_type *type);
+static b8 lower_block(lower_t *, ast_node_t *);
+static i64 lower_function(comptime_t *, ast_node_t *);
+
+void comptime_init(comptime_t *c) {
+  vm_init(&c->vm);
+  c->da_functions = darray_init(vm_function_t);
+  c->da_sources = darray_init(ast_node_t *);
+}
+
+// Drops the functions from count on, along with any native code they got
+static void truncate_functions(comptime_t *c, u64 count) {
+  for (u64 i = count; i < darray_len(c->da_functions); i++)
+    vm_release_function(&c->da_functions[i]);
+  darray_info(c->da_functions)->count = count;
+  darray_info(c->da_sources)->count = count;
+}
+
+void comptime_deinit(comptime_t *c) {
+  truncate_functions(c, 0);
+  darray_deinit(c->da_functions);
+  darray_deinit(c->da_sources);
+}
+
+static u32 new_register(lower_t *l) {
+  u32 reg = l->next_register++;
+  if (l->next_register > l->register_count)
+    l->register_count = l->next_register;
+  return reg;
+}
+
+static void load(lower_t *l, u32 reg, ika_value value) {
+  bytecode_emit(&l->b, LOAD, 2, reg, bytecode_constant(&l->b, value));
+}
+
+static local_t *find_local(lower_t *l, char *name) {
+  for (u64 i = darray_len(l->da_locals); i > 0; i--) {
+    if (strcmp(l->da_locals[i - 1].name, name) == 0)
+      return &l->da_locals[i - 1];
+  }
+  return NULL;
+}
+
+static b8 lower_binary(lower_t *l, e_token_type op, ast_node_t *left,
+                       ast_node_t *right, u32 *reg, e_token_type *type) {
+  u32 a, b;
+  e_token_type left_type, right_type;
+  if (!lower_expr(l, left, &a, &left_type) ||
+      !lower_expr(l, right, &b, &right_type))
+    return FALSE;
+  // Mixing ints and floats promotes the int, as the typechecker does
+  if (left_type == TOKEN_INT && right_type == TOKEN_FLOAT) {
+    u32 promoted = new_register(l);
+    bytecode_emit(&l->b, I64_TO_F64, 2, promoted, a);
+    a = promoted;
+    left_type = TOKEN_FLOAT;
+  } else if (left_type == TOKEN_FLOAT && right_type == TOKEN_INT) {
+    u32 promoted = new_register(l);
+    bytecode_emit(&l->b, I64_TO_F64, 2, promoted, b);
+    b = promoted;
+    right_type = TOKEN_FLOAT;
+  }
+  if (left_type != right_type)
+    return FALSE;
+  b8 comparison = op == TOKEN_EQL || op == TOKEN_NEQ || op == TOKEN_GT ||
+                  op == TOKEN_GTE || op == TOKEN_LT || op == TOKEN_LTE;
+  if (left_type == TOKEN_BOOL && op != TOKEN_EQL && op != TOKEN_NEQ)
+    return FALSE;
+  u8 opcode = bytecode_binary_opcode(op, bytecode_value_type(left_type));
+  if (opcode == OPCODE_COUNT)
+    return FALSE;
+  *reg = new_register(l);
+  bytecode_emit(&l->b, opcode, 3, *reg, a, b);
+  *type = comparison ? TOKEN_BOOL : left_type;
+  return TRUE;
+}
+
+// Lowers the callee of call and its arguments, which end up in consecutive
+// registers from first_arg.  Returns the callee's index in the program, or
+// -1 if the call can't be made at compile time.
+static i64 lower_arguments(lower_t *l, fn_call_t *call, fn_t **callee,
+                           u32 *first_arg) {
+  symbol_table_entry_t *entry = call->symbol->symbol.entry;
+  if (!entry || entry->type != TOKEN_KEYWORD_FN)
+    return -1;
+  fn_t *fn = &((ast_node_t *)entry->node_address)->fn;
+  u32 arg_count = small_vec_len(call->exprs);
+  if (arg_count != small_vec_len(fn->parameters))
+    return -1;
+  i64 function = lower_function(l->comptime, entry->node_address);
+  if (function < 0)
+    return -1;
+
+  *callee = fn;
+  *first_arg = l->next_register;
+  for (u32 i = 0; i < arg_count; i++)
+    new_register(l);
+  for (u32 i = 0; i < arg_count; i++) {
+    u32 mark = l->next_register;
+    u32 arg;
+    e_token_type arg_type;
+    if (!lower_expr(l, small_vec_get(call->exprs, i), &arg, &arg_type) ||
+        arg_type != small_vec_get(fn->parameters, i)->decl.type)
+      return -1;
+    bytecode_emit(&l->b, MOV, 2, *first_arg + i, arg);
+    l->next_register = mark;
+  }
+  return function;
+}
+
+static b8 lower_call(lower_t *l, ast_node_t *node, u32 *reg,
+                     e_token_type *type) {
+  fn_call_t *call = &node->fn_call;
+  fn_t *fn;
+  u32 first_arg;
+  i64 function = lower_arguments(l, call, &fn, &first_arg);
+  if (function < 0)
+    return FALSE;
+  *reg = new_register(l);
+  bytecode_emit(&l->b, CALL, 4, *reg, (u32)function, first_arg,
+                (u32)small_vec_len(call->exprs));
+  *type = fn->return_type;
+  return TRUE;
+}
+
+static b8 lower_expr(lower_t *l, ast_node_t *node, u32 *reg,
+                     e_token_type *type) {
+  switch (node->type) {
+  case ast_int_literal:
+    *reg = new_register(l);
+    *type = TOKEN_INT;
+    load(l, *reg,
+         (ika_value){.type = IKA_INT, .integer = node->literal.integer_value});
+    return TRUE;
+  case ast_bool_literal:
+    *reg = new_register(l);
+    *type = TOKEN_BOOL;
+    load(l, *reg,
+         (ika_value){.type = IKA_INT,
+                     .integer = node->literal.integer_value != 0});
+    return TRUE;
+  case ast_float_literal:
+    *reg = new_register(l);
+    *type = TOKEN_FLOAT;
+    load(l, *reg,
+         (ika_value){.type = IKA_FLOAT, .floating = node->literal.float_value});
+    return TRUE;
+  case ast_str_literal:
+    *reg = new_register(l);
+    *type = TOKEN_STR;
+    load(l, *reg,
+         (ika_value){.type = IKA_STR, .string = node->literal.string_value});
+    return TRUE;
+  case ast_symbol: {
+    // Only parameters and locals, a global could be assigned before the
+    // call would have run
+    local_t *local = find_local(l, node->symbol.value);
+    if (!local)
+      return FALSE;
+    *reg = local->reg;
+    *type = local->type;
+    return TRUE;
+  }
+  case ast_expr:
+    return lower_binary(l, node->expr.op, node->expr.left, node->expr.right,
+                        reg, type);
+  case ast_term:
+    return lower_binary(l, node->term.op, node->term.left, node->term.right,
+                        reg, type);
+  case ast_fn_call:
+    return lower_call(l, node, reg, type);
+  default:
+    return FALSE;
+  }
+}
+
+static b8 lower_return(lower_t *l, ast_node_t *node) {
+  if (!node->returns.expr) {
+    if (l->return_type != TOKEN_VOID)
+      return FALSE;
+    bytecode_emit(&l->b, EOP, 0);
+    return TRUE;
+  }
+  // A call in return position becomes a tail call, which reuses this
+  // function's frame
+  if (node->returns.expr->type == ast_fn_call) {
+    fn_call_t *call = &node->returns.expr->fn_call;
+    fn_t *fn;
+    u32 first_arg;
+    i64 function = lower_arguments(l, call, &fn, &first_arg);
+    if (function < 0 || fn->return_type != l->return_type)
+      return FALSE;
+    bytecode_emit(&l->b, TAIL_CALL, 3, (u32)function, first_arg,
+                  (u32)small_vec_len(call->exprs));
+    return TRUE;
+  }
+  u32 reg;
+  e_token_type type;
+  if (!lower_expr(l, node->returns.expr, &reg, &type) ||
+      type != l->return_type)
+    return FALSE;
+  bytecode_emit(&l->b, RETURN, 1, reg);
+  return TRUE;
+}
+
+// Anything with a side effect other than on locals (printing, assigning a
+// global, defining a function) makes the function impure and fails.
+static b8 lower_statement(lower_t *l, ast_node_t *node) {
+  u32 reg;
+  e_token_type type;
+  switch (node->type) {
+  case ast_decl: {
+    decl_t *decl = &node->decl;
+    e_ika_vm_type value_type = bytecode_value_type(decl->type);
+    if (value_type == IKA_NONE)
+      return FALSE;
+    // Claimed before the initializer is lowered, which may still refer to a
+    // symbol this one shadows
+    u32 local = new_register(l);
+    if (decl->expr) {
+      if (!lower_expr(l, decl->expr, &reg, &type) || type != decl->type)
+        return FALSE;
+      bytecode_emit(&l->b, MOV, 2, local, reg);
+    } else if (value_type == IKA_STR) {
+      load(l, local, (ika_value){.type = IKA_STR, .string = ""});
+    } else {
+      load(l, local, (ika_value){.type = value_type, .value = 0});
+    }
+    local_t entry = {
+        .name = decl->symbol->symbol.value, .reg = local, .type = decl->type};
+    darray_append(l->da_locals, entry);
+    return TRUE;
+  }
+  case ast_assignment: {
+    local_t *local = find_local(l, node->assignment.symbol->symbol.value);
+    if (!local || !lower_expr(l, node->assignment.expr, &reg, &type) ||
+        type != local->type)
+      return FALSE;
+    bytecode_emit(&l->b, MOV, 2, local->reg, reg);
+    return TRUE;
+  }
+  case ast_if_stmt: {
+    if_t *if_stmt = &node->if_stmt;
+    if (!lower_expr(l, if_stmt->expr, &reg, &type) || type != TOKEN_BOOL)
+      return FALSE;
+    u32 skip_if = bytecode_emit_jump(&l->b, JUMP_IF_FALSE, reg, 0);
+    if (!lower_block(l, if_stmt->if_block))
+      return FALSE;
+    if (!if_stmt->else_block) {
+      bytecode_patch_jump(&l->b, skip_if, bytecode_position(&l->b));
+      return TRUE;
+    }
+    u32 skip_else = bytecode_emit_jump(&l->b, JUMP, 0, 0);
+    bytecode_patch_jump(&l->b, skip_if, bytecode_position(&l->b));
+    if (!lower_block(l, if_stmt->else_block))
+      return FALSE;
+    bytecode_patch_jump(&l->b, skip_else, bytecode_position(&l->b));
+    return TRUE;
+  }
+  case ast_block:
+    return lower_block(l, node);
+  case ast_int_literal:
+  case ast_float_literal:
+  case ast_str_literal:
+  case ast_bool_literal:
+  case ast_symbol:
+  case ast_expr:
+  case ast_term:
+  case ast_fn_call:
+    return lower_expr(l, node, &reg, &type);
+  default:
+    return FALSE;
+  }
+}
+
+static b8 lower_block(lower_t *l, ast_node_t *node) {
+  if (node->type != ast_block)
+    return FALSE;
+  block_t *block = &node->block;
+  u64 local_count = darray_len(l->da_locals);
+  u32 register_mark = l->next_register;
+  b8 lowered = TRUE;
+  for (u32 i = 0; lowered && i < small_vec_len(block->nodes); i++) {
+    ast_node_t *child = small_vec_get(block->nodes, i);
+    u32 mark = l->next_register;
+    lowered = lower_statement(l, child);
+    // Temporaries die with their statement, a declaration's local doesn't
+    l->next_register = mark + (child->type == ast_decl);
+  }
+  if (lowered && block->return_statement)
+    lowered = lower_return(l, block->return_statement);
+  darray_info(l->da_locals)->count = local_count;
+  l->next_register = register_mark;
+  return lowered;
+}
+
+// Returns the function's index in the program, lowering it the first time
+// it's asked for, or -1 if it can't be run at compile time.
+static i64 lower_function(comptime_t *c, ast_node_t *node) {
+  for (u64 i = 0; i < darray_len(c->da_sources); i++) {
+    if (c->da_sources[i] == node)
+      return (i64)i;
+  }
+  fn_t *fn = &node->fn;
+  e_ika_vm_type return_type = bytecode_value_type(fn->return_type);
+  if (return_type == IKA_NONE && fn->return_type != TOKEN_VOID)
+    return -1;
+
+  // Claimed up front so recursive calls can refer to it
+  i64 index = (i64)darray_len(c->da_functions);
+  vm_function_t placeholder = {0};
+  darray_append(c->da_functions, placeholder);
+  darray_append(c->da_sources, node);
+
+  lower_t l = {.comptime = c,
+               .da_locals = darray_init(local_t),
+               .return_type = fn->return_type};
+  bytecode_builder_init(&l.b);
+  u32 parameter_count = small_vec_len(fn->parameters);
+  e_ika_vm_type *parameter_types =
+      imust_alloc(sizeof(e_ika_vm_type) * (parameter_count + 1));
+  b8 lowered = TRUE;
+  for (u32 i = 0; i < parameter_count; i++) {
+    decl_t *param = &small_vec_get(fn->parameters, i)->decl;
+    parameter_types[i] = bytecode_value_type(param->type);
+    if (parameter_types[i] == IKA_NONE)
+      lowered = FALSE;
+    local_t entry = {.name = param->symbol->symbol.value,
+                     .reg = new_register(&l),
+                     .type = param->type};
+    darray_append(l.da_locals, entry);
+  }
+  lowered = lowered && lower_block(&l, fn->block);
+  darray_deinit(l.da_locals);
+  if (!lowered)
+    return -1;
+  // Only reached by a void function that ends without a return
+  bytecode_emit(&l.b, EOP, 0);
+  c->da_functions[index] =
+      bytecode_finish(&l.b, fn->symbol->symbol.value, parameter_count,
+                      parameter_types, return_type, l.register_count);
+  return index;
+}
+
+// Runs a call as the body of a parameterless function
+static b8 evaluate(comptime_t *c, ast_node_t *call, ika_value *value,
+                   e_token_type *type) {
+  lower_t l = {.comptime = c, .da_locals = darray_init(local_t)};
+  bytecode_builder_init(&l.b);
+  u32 reg;
+  b8 lowered = lower_call(&l, call, &reg, type) &&
+               bytecode_value_type(*type) != IKA_NONE;
+  darray_deinit(l.da_locals);
+  if (!lowered)
+    return FALSE;
+  bytecode_emit(&l.b, RETURN, 1, reg);
+  u32 thunk = (u32)darray_len(c->da_functions);
+  vm_function_t function =
+      bytecode_finish(&l.b, "comptime", 0, NULL, bytecode_value_type(*type),
+                      l.register_count);
+  darray_append(c->da_functions, function);
+  darray_append(c->da_sources, NULL);
+
+  vm_program_t program = {.functions = c->da_functions,
+                          .function_count = thunk + 1};
+  c->vm.fuel = COMPTIME_FUEL;
+  return vm_load(&c->vm, &program) &&
+         vm_execute(&c->vm, &program, thunk, NULL, value);
+}
+
+// Whether a literal can stand in for value, C has none for infinities and
+// NaNs.
+static b8 has_literal(ika_value value, e_token_type type) {
+  return type != TOKEN_FLOAT || isfinite(value.floating);
+}
+
+static void replace_with_literal(ast_node_t *node, ika_value value,
+                                 e_token_type type) {
+  switch (type) {
+  case TOKEN_INT:
+    node->type = ast_int_literal;
+    node->literal.integer_value = value.integer;
+    break;
+  case TOKEN_BOOL:
+    node->type = ast_bool_literal;
+    node->literal.integer_value = value.integer != 0;
+    break;
+  case TOKEN_FLOAT:
+    node->type = ast_float_literal;
+    node->literal.float_value = value.floating;
+    break;
+  case TOKEN_STR:
+    node->type = ast_str_literal;
+    node->literal.string_value = value.string;
+    break;
+  default:
+    ASSERT_MSG((FALSE), "Unexpected type for a compile time value");
+  }
+}
+
+void comptime_fold_calls(comptime_t *c, ast_node_t *expr) {
+  switch (expr->type) {
+  case ast_fn_call: {
+    u64 function_count = darray_len(c->da_functions);
+    ika_value value;
+    e_token_type type;
+    b8 evaluated = evaluate(c, expr, &value, &type);
+    // Functions lowered along the way are kept for later calls, unless
+    // evaluation failed and one of them may be to blame.  The thunk never is.
+    if (evaluated)
+      function_count = darray_len(c->da_functions) - 1;
+    truncate_functions(c, function_count);
+    if (evaluated && has_literal(value, type)) {
+      replace_with_literal(expr, value, type);
+    } else {
+      for (u32 i = 0; i < small_vec_len(expr->fn_call.exprs); i++)
+        comptime_fold_calls(c, small_vec_get(expr->fn_call.exprs, i));
+    }
+    break;
+  }
+  case ast_expr:
+    comptime_fold_calls(c, expr->expr.left);
+    comptime_fold_calls(c, expr->expr.right);
+    break;
+  case ast_term:
+    comptime_fold_calls(c, expr->term.left);
+    comptime_fold_calls(c, expr->term.right);
+    break;
+  default:
+    break;
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ast.h"
+#include "symbol_table.h"
+#include "vm.h"
+
+// Compile time evaluation
+//
+// Pure functions, ones that only touch their parameters and locals and
+// don't print, are lowered to bytecode the first time a constant context
+// calls them and run on the vm.  The call node is then replaced by a literal
+// holding the result, so the backends never see it.
+
+// Calls and taken jumps a single evaluation may make before it's abandoned
+// and the call is left for runtime.
+#define COMPTIME_FUEL (1024 * 1024)
+
+typedef struct comptime_t {
+  vm_t vm;
+  // Every function lowered so far, and the fn node each was lowered from
+  vm_function_t *da_functions;
+  ast_node_t **da_sources;
+} comptime_t;
+
+void comptime_init(comptime_t *);
+
+// Frees the functions lowered so far and any native code they were compiled
+// to
+void comptime_deinit(comptime_t *);
+
+// Replaces every call in expr that can be evaluated now with its result.
+// The calls have to have been bound by the resolver.
+void comptime_fold_calls(comptime_t *, ast_node_t *expr);
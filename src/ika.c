@@ -13,19 +13,21 @@ typedef struct cmdargs {
   char *src_file;
   u64 src_len;
   b8 verbose;
+  b8 stats;
 } cmdargs;
 
 static void print_help() {
-  printf("Usage: ika [-v] source_file\n\n");
+  printf("Usage: ika [-v] [-stats] source_file\n\n");
   printf("-v  Output verbose information about the compilation process.\n");
+  printf("-stats  Report memory usage per pass and per allocation site.\n");
   printf("-h  Print this help message.\n");
   printf("source_file  A source file to compile.\n\n");
 }
 
 static cmdargs parse_args(int argc, char **argv) {
-  cmdargs args = {.is_valid = FALSE, .verbose = FALSE};
+  cmdargs args = {.is_valid = FALSE, .verbose = FALSE, .stats = FALSE};
   struct stat info;
-  if (argc > 3 || argc <= 1)
+  if (argc > 4 || argc <= 1)
     return args;
   for (int i = 0; i < argc; i++) {
     if (argv[i][0] == '-') { // it's a flag
@@ -33,6 +35,8 @@ static cmdargs parse_args(int argc, char **argv) {
         return args;
       } else if (streq(argv[i], "-v")) {
         args.verbose = TRUE;
+      } else if (streq(argv[i], "-stats")) {
+        args.stats = TRUE;
       } else {
         printf("Unknown flag %s\n\n", argv[i]);
         return args;
@@ -65,9 +69,11 @@ int main(int argc, char **argv) {
 
   cmdargs args = parse_args(argc, argv);
   if (args.is_valid) {
+    if (args.stats)
+      allocator_enable_stats();
     // Create a compilation unit around the source file, and compile it.
-    compilation_unit_t *unit =
-        new_compilation_unit(args.src_file, args.src_len, args.verbose);
+    compilation_unit_t *unit = new_compilation_unit(
+        args.src_file, args.src_len, args.verbose, args.stats);
     compile(unit);
   } else {
     print_help();
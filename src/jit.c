@@ -0,0 +1,673 @@
+// MAP_ANONYMOUS isn't POSIX, glibc only declares it under -std=c11 if asked
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../lib/allocator.h"
+#include "../lib/assert.h"
+
+#include "bytecode.h"
+#include "jit.h"
+#include "rt/darray.h"
+
+#ifdef VM_JIT
+
+// x86-64 register numbers
+enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R9 = 9,
+  R11 = 11,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+// Compiled code keeps its arguments in callee saved registers for its whole
+// run, so calls out to C don't disturb them.
+enum {
+  REGISTERS = RBX,
+  PROGRAM = R12,
+  VM = R13,
+  FRAME = R14,
+  RESULT = R15,
+};
+
+// Condition codes, as used by jcc and setcc
+enum {
+  CC_ALWAYS = -1,
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_P = 0xA,
+  CC_NP = 0xB,
+  CC_L = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G = 0xF,
+};
+
+typedef struct jit_fixup_t {
+  // Where a jump's rel32 is, and the bytecode offset it goes to
+  u32 at;
+  u32 target;
+} jit_fixup_t;
+
+typedef struct jit_t {
+  vm_program_t *program;
+  vm_function_t *fn;
+  u8 *da_code;
+  // Native offset of each bytecode offset an instruction starts at
+  u32 *offsets;
+  // Jumps to bytecode offsets, resolved once every instruction is emitted
+  jit_fixup_t *da_fixups;
+  // Shared exits, emitted ahead of the body so they're always known
+  u32 out_of_fuel;
+  u32 division_by_zero;
+  u32 division_overflow;
+  u32 fail;
+  u32 epilogue;
+  // Where the code for the first instruction starts
+  u32 body;
+} jit_t;
+
+static u32 here(jit_t *j) { return (u32)darray_len(j->da_code); }
+
+static void emit(jit_t *j, u8 byte) { darray_append(j->da_code, byte); }
+
+static void emit_bytes(jit_t *j, u32 count, ...) {
+  va_list bytes;
+  va_start(bytes, count);
+  for (u32 i = 0; i < count; i++)
+    emit(j, (u8)va_arg(bytes, int));
+  va_end(bytes);
+}
+
+static void emit_u32(jit_t *j, u32 value) {
+  darray_append_n(j->da_code, &value, sizeof(value));
+}
+
+static void emit_u64(jit_t *j, u64 value) {
+  darray_append_n(j->da_code, &value, sizeof(value));
+}
+
+// Emits an instruction with a [base + disp] memory operand.  Opcodes above
+// 0xff are two byte 0x0f escaped ones, prefix is a mandatory prefix (0 for
+// none) and wide asks for 64 bit operands.  reg is either a register or the
+// opcode extension, depending on the instruction.
+static void emit_memory(jit_t *j, u8 prefix, b8 wide, u16 opcode, u8 reg,
+                        u8 base, i32 disp) {
+  if (prefix)
+    emit(j, prefix);
+  u8 rex = 0x40 | (wide ? 0x08 : 0) | (reg >> 3) << 2 | base >> 3;
+  if (rex != 0x40)
+    emit(j, rex);
+  if (opcode > 0xff)
+    emit(j, opcode >> 8);
+  emit(j, opcode & 0xff);
+  // Always giving a displacement keeps rbp and r13 from meaning rip
+  b8 short_disp = disp >= -128 && disp <= 127;
+  emit(j, (short_disp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+  // rsp and r12 as a base can only be given through a SIB byte
+  if ((base & 7) == RSP)
+    emit(j, 0x24);
+  if (short_disp)
+    emit(j, (u8)disp);
+  else
+    emit_u32(j, (u32)disp);
+}
+
+static void emit_mov_register(jit_t *j, u8 dst, u8 src) {
+  emit_bytes(j, 3, 0x48 | (src >> 3) << 2 | dst >> 3, 0x89,
+             0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+static void emit_mov_immediate(jit_t *j, u8 dst, u64 value) {
+  emit_bytes(j, 2, 0x48 | dst >> 3, 0xb8 + (dst & 7));
+  emit_u64(j, value);
+}
+
+static void emit_call(jit_t *j, u64 function) {
+  emit_mov_immediate(j, RAX, function);
+  emit_bytes(j, 2, 0xff, 0xd0); // call rax
+}
+
+// Emits a jump with its rel32 left to be filled in, returning where it is
+static u32 emit_jump(jit_t *j, i32 cc) {
+  if (cc == CC_ALWAYS)
+    emit(j, 0xe9);
+  else
+    emit_bytes(j, 2, 0x0f, 0x80 + cc);
+  u32 at = here(j);
+  emit_u32(j, 0);
+  return at;
+}
+
+static void patch_jump(jit_t *j, u32 at, u32 destination) {
+  i32 rel = (i32)destination - (i32)(at + sizeof(rel));
+  memcpy(j->da_code + at, &rel, sizeof(rel));
+}
+
+static void emit_jump_to(jit_t *j, i32 cc, u32 destination) {
+  patch_jump(j, emit_jump(j, cc), destination);
+}
+
+static void emit_jump_to_target(jit_t *j, i32 cc, u32 target) {
+  jit_fixup_t fixup = {.at = emit_jump(j, cc), .target = target};
+  darray_append(j->da_fixups, fixup);
+}
+
+static void emit_burn_fuel(jit_t *j) {
+  // sub qword [vm + fuel], 1 borrows once there's none left
+  emit_memory(j, 0, TRUE, 0x83, 5, VM, offsetof(vm_t, fuel));
+  emit(j, 1);
+  emit_jump_to(j, CC_B, j->out_of_fuel);
+}
+
+static void emit_taken_jump(jit_t *j, u32 target) {
+  emit_burn_fuel(j);
+  emit_jump_to_target(j, CC_ALWAYS, target);
+}
+
+// Displacements of vm register r, its type and its value from REGISTERS
+static i32 slot_of(u32 r) { return (i32)(r * sizeof(ika_value)); }
+
+static i32 type_of(u32 r) {
+  return slot_of(r) + (i32)offsetof(ika_value, type);
+}
+
+static i32 value_of(u32 r) {
+  return slot_of(r) + (i32)offsetof(ika_value, value);
+}
+
+static void emit_set_type(jit_t *j, u8 base, i32 disp, e_ika_vm_type type) {
+  emit_memory(j, 0, FALSE, 0xc7, 0, base, disp);
+  emit_u32(j, type);
+}
+
+static void emit_load(jit_t *j, u8 reg, u32 r) {
+  emit_memory(j, 0, TRUE, 0x8b, reg, REGISTERS, value_of(r));
+}
+
+static void emit_store_int(jit_t *j, u32 r, u8 reg) {
+  emit_set_type(j, REGISTERS, type_of(r), IKA_INT);
+  emit_memory(j, 0, TRUE, 0x89, reg, REGISTERS, value_of(r));
+}
+
+// Stores the flag setcc put in al as an int 0 or 1
+static void emit_store_bool(jit_t *j, u32 r) {
+  emit_bytes(j, 3, 0x0f, 0xb6, 0xc0); // movzx eax, al
+  emit_store_int(j, r, RAX);
+}
+
+static void emit_setcc(jit_t *j, u8 cc, u8 reg) {
+  emit_bytes(j, 3, 0x0f, 0x90 + cc, 0xc0 | reg);
+}
+
+// Copies a whole value a field at a time.  Values are written that way, so
+// reading one back in a single wider load would defeat store forwarding.
+static void emit_copy(jit_t *j, u8 dst_base, i32 dst, u8 src_base, i32 src) {
+  i32 type = offsetof(ika_value, type), value = offsetof(ika_value, value);
+  emit_memory(j, 0, FALSE, 0x8b, RAX, src_base, src + type);
+  emit_memory(j, 0, FALSE, 0x89, RAX, dst_base, dst + type);
+  emit_memory(j, 0, TRUE, 0x8b, RAX, src_base, src + value);
+  emit_memory(j, 0, TRUE, 0x89, RAX, dst_base, dst + value);
+}
+
+static void emit_constant(jit_t *j, u32 dst, u32 k) {
+  ika_value constant = j->fn->constants[k];
+  emit_set_type(j, REGISTERS, type_of(dst), constant.type);
+  emit_mov_immediate(j, RAX, constant.value);
+  emit_memory(j, 0, TRUE, 0x89, RAX, REGISTERS, value_of(dst));
+}
+
+static void emit_int_binary(jit_t *j, u16 opcode, u32 dst, u32 a, u32 b) {
+  emit_load(j, RAX, a);
+  emit_memory(j, 0, TRUE, opcode, RAX, REGISTERS, value_of(b));
+  emit_store_int(j, dst, RAX);
+}
+
+// Leaves the flags of the comparison set
+static void emit_int_compare(jit_t *j, u8 cc, u32 dst, u32 a, u32 b) {
+  emit_load(j, RAX, a);
+  emit_memory(j, 0, TRUE, 0x3b, RAX, REGISTERS, value_of(b)); // cmp
+  emit_setcc(j, cc, RAX);
+  emit_store_bool(j, dst);
+}
+
+static void emit_division(jit_t *j, b8 remainder, u32 dst, u32 a, u32 b) {
+  emit_load(j, RAX, a);
+  emit_load(j, RCX, b);
+  emit_bytes(j, 3, 0x48, 0x85, 0xc9); // test rcx, rcx
+  emit_jump_to(j, CC_E, j->division_by_zero);
+  emit_bytes(j, 4, 0x48, 0x83, 0xf9, 0xff); // cmp rcx, -1
+  u32 divide = emit_jump(j, CC_NE);
+  emit_mov_immediate(j, RDX, (u64)INT64_MIN);
+  emit_bytes(j, 3, 0x48, 0x39, 0xd0); // cmp rax, rdx
+  emit_jump_to(j, CC_E, j->division_overflow);
+  patch_jump(j, divide, here(j));
+  emit_bytes(j, 2, 0x48, 0x99);       // cqo
+  emit_bytes(j, 3, 0x48, 0xf7, 0xf9); // idiv rcx
+  emit_store_int(j, dst, remainder ? RDX : RAX);
+}
+
+static void emit_float_binary(jit_t *j, u16 opcode, u32 dst, u32 a, u32 b) {
+  emit_memory(j, 0xf2, FALSE, 0x0f10, 0, REGISTERS, value_of(a)); // movsd
+  emit_memory(j, 0xf2, FALSE, opcode, 0, REGISTERS, value_of(b));
+  emit_memory(j, 0xf2, FALSE, 0x0f11, 0, REGISTERS, value_of(dst));
+  emit_set_type(j, REGISTERS, type_of(dst), IKA_FLOAT);
+}
+
+// ucomisd reports a NaN operand as unordered by setting ZF, PF and CF
+// together, which has to compare false for everything but NE_F64.  Less
+// than is done as a swapped greater than, so that it's decided by CF and ZF
+// like the rest.
+static void emit_float_compare(jit_t *j, u8 opcode, u32 dst, u32 a, u32 b) {
+  if (opcode == LT_F64 || opcode == LTE_F64) {
+    u32 swap = a;
+    a = b;
+    b = swap;
+  }
+  emit_memory(j, 0xf2, FALSE, 0x0f10, 0, REGISTERS, value_of(a)); // movsd
+  emit_memory(j, 0x66, FALSE, 0x0f2e, 0, REGISTERS, value_of(b)); // ucomisd
+  switch (opcode) {
+  case EQ_F64:
+    emit_setcc(j, CC_E, RAX);
+    emit_setcc(j, CC_NP, RCX);
+    emit_bytes(j, 2, 0x20, 0xc8); // and al, cl
+    break;
+  case NE_F64:
+    emit_setcc(j, CC_NE, RAX);
+    emit_setcc(j, CC_P, RCX);
+    emit_bytes(j, 2, 0x08, 0xc8); // or al, cl
+    break;
+  case GT_F64:
+  case LT_F64:
+    emit_setcc(j, CC_A, RAX);
+    break;
+  default:
+    emit_setcc(j, CC_AE, RAX);
+    break;
+  }
+  emit_store_bool(j, dst);
+}
+
+// Calls straight into the callee's native code once it has some, checking
+// for overflow the way vm_call would.  Until then, and when the checks fail,
+// the call goes through vm_call.
+static void emit_call_function(jit_t *j, u32 dst, u32 function,
+                               u32 first_arg) {
+  vm_function_t *callee = &j->program->functions[function];
+  u32 callee_registers = j->fn->register_count;
+  emit_burn_fuel(j);
+
+  u32 slow_paths[3];
+  u32 slow_path_count = 0;
+  if (callee->register_count <= VM_STACK_SIZE) {
+    emit_memory(j, 0, TRUE, 0x8b, R11, PROGRAM,
+                offsetof(vm_program_t, functions));
+    emit_memory(j, 0, TRUE, 0x8b, R11, R11,
+                function * sizeof(vm_function_t) +
+                    offsetof(vm_function_t, native));
+    emit_bytes(j, 3, 0x4d, 0x85, 0xdb); // test r11, r11
+    slow_paths[slow_path_count++] = emit_jump(j, CC_E);
+
+    emit_memory(j, 0, TRUE, 0x8b, RDX, VM, offsetof(vm_t, frames));
+    emit_bytes(j, 3, 0x48, 0x81, 0xc2); // add rdx, imm32
+    emit_u32(j, (VM_MAX_FRAMES - 1) * sizeof(vm_frame_t));
+    emit_bytes(j, 3, 0x49, 0x39, 0xd6); // cmp r14, rdx
+    slow_paths[slow_path_count++] = emit_jump(j, CC_E);
+    emit_memory(j, 0, TRUE, 0x8b, RDX, VM, offsetof(vm_t, stack));
+    emit_bytes(j, 3, 0x48, 0x81, 0xc2); // add rdx, imm32
+    emit_u32(j, VM_STACK_SIZE * sizeof(ika_value));
+    emit_memory(j, 0, TRUE, 0x8d, RCX, REGISTERS,
+                slot_of(callee_registers + callee->register_count)); // lea
+    emit_bytes(j, 3, 0x48, 0x39, 0xd1); // cmp rcx, rdx
+    slow_paths[slow_path_count++] = emit_jump(j, CC_A);
+
+    for (u32 i = 0; i < callee->parameter_count; i++)
+      emit_copy(j, REGISTERS, slot_of(callee_registers + i), REGISTERS,
+                slot_of(first_arg + i));
+    emit_mov_register(j, RDI, VM);
+    emit_mov_register(j, RSI, PROGRAM);
+    emit_memory(j, 0, TRUE, 0x8d, RDX, FRAME, sizeof(vm_frame_t)); // lea
+    emit_memory(j, 0, TRUE, 0x8d, RCX, REGISTERS, slot_of(callee_registers));
+    emit_memory(j, 0, TRUE, 0x8d, R8, REGISTERS, slot_of(dst));
+    emit_bytes(j, 3, 0x41, 0xff, 0xd3); // call r11
+  }
+  u32 done = emit_jump(j, CC_ALWAYS);
+
+  for (u32 i = 0; i < slow_path_count; i++)
+    patch_jump(j, slow_paths[i], here(j));
+  emit_mov_register(j, RDI, VM);
+  emit_mov_register(j, RSI, PROGRAM);
+  emit_mov_register(j, RDX, FRAME);
+  emit(j, 0xb9); // mov ecx, imm32
+  emit_u32(j, function);
+  emit_bytes(j, 2, 0x41, 0xb8); // mov r8d, imm32
+  emit_u32(j, first_arg);
+  emit_memory(j, 0, TRUE, 0x8d, R9, REGISTERS, slot_of(dst)); // lea
+  emit_call(j, (u64)vm_call);
+
+  patch_jump(j, done, here(j));
+  emit_bytes(j, 2, 0x84, 0xc0); // test al, al
+  emit_jump_to(j, CC_E, j->fail);
+}
+
+// Restores what the prologue saved, leaving the return address on top
+static void emit_leave(jit_t *j) {
+  emit_bytes(j, 4, 0x48, 0x83, 0xc4, 0x08);
+  emit_bytes(j, 10, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b,
+             0x5d);
+}
+
+// Tail calls to the function itself jump back to the start of its body.
+// Ones to a function that has native code leave this function's native
+// frame and jump into the callee, with the same arguments it was called
+// with, once its registers are known to fit.  Anything else goes through
+// vm_tail_call.
+static void emit_tail_call(jit_t *j, u32 function, u32 first_arg) {
+  vm_function_t *callee = &j->program->functions[function];
+  emit_burn_fuel(j);
+  if (callee == j->fn) {
+    for (u32 i = 0; i < callee->parameter_count; i++)
+      emit_copy(j, REGISTERS, slot_of(i), REGISTERS, slot_of(first_arg + i));
+    emit_jump_to(j, CC_ALWAYS, j->body);
+    return;
+  }
+
+  u32 slow_paths[2];
+  u32 slow_path_count = 0;
+  if (callee->register_count <= VM_STACK_SIZE) {
+    emit_memory(j, 0, TRUE, 0x8b, R11, PROGRAM,
+                offsetof(vm_program_t, functions));
+    emit_memory(j, 0, TRUE, 0x8b, R11, R11,
+                function * sizeof(vm_function_t) +
+                    offsetof(vm_function_t, native));
+    emit_bytes(j, 3, 0x4d, 0x85, 0xdb); // test r11, r11
+    slow_paths[slow_path_count++] = emit_jump(j, CC_E);
+    emit_memory(j, 0, TRUE, 0x8b, RDX, VM, offsetof(vm_t, stack));
+    emit_bytes(j, 3, 0x48, 0x81, 0xc2); // add rdx, imm32
+    emit_u32(j, VM_STACK_SIZE * sizeof(ika_value));
+    emit_memory(j, 0, TRUE, 0x8d, RCX, REGISTERS,
+                slot_of(callee->register_count)); // lea
+    emit_bytes(j, 3, 0x48, 0x39, 0xd1); // cmp rcx, rdx
+    slow_paths[slow_path_count++] = emit_jump(j, CC_A);
+    for (u32 i = 0; i < callee->parameter_count; i++)
+      emit_copy(j, REGISTERS, slot_of(i), REGISTERS, slot_of(first_arg + i));
+    emit_mov_register(j, RDI, VM);
+    emit_mov_register(j, RSI, PROGRAM);
+    emit_mov_register(j, RDX, FRAME);
+    emit_mov_register(j, RCX, REGISTERS);
+    emit_mov_register(j, R8, RESULT);
+    emit_leave(j);
+    emit_bytes(j, 3, 0x41, 0xff, 0xe3); // jmp r11
+  }
+  for (u32 i = 0; i < slow_path_count; i++)
+    patch_jump(j, slow_paths[i], here(j));
+  emit_mov_register(j, RDI, VM);
+  emit_mov_register(j, RSI, PROGRAM);
+  emit_mov_register(j, RDX, FRAME);
+  emit(j, 0xb9); // mov ecx, imm32
+  emit_u32(j, function);
+  emit_bytes(j, 2, 0x41, 0xb8); // mov r8d, imm32
+  emit_u32(j, first_arg);
+  emit_mov_register(j, R9, RESULT);
+  emit_call(j, (u64)vm_tail_call);
+  emit_jump_to(j, CC_ALWAYS, j->epilogue);
+}
+
+static void emit_prologue(jit_t *j, u32 function) {
+  emit_bytes(j, 4, 0x55, 0x48, 0x89, 0xe5); // push rbp; mov rbp, rsp
+  emit_bytes(j, 9, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+  emit_bytes(j, 4, 0x48, 0x83, 0xec, 0x08); // keep rsp 16 byte aligned
+  emit_mov_register(j, VM, RDI);
+  emit_mov_register(j, PROGRAM, RSI);
+  emit_mov_register(j, FRAME, RDX);
+  emit_mov_register(j, REGISTERS, RCX);
+  emit_mov_register(j, RESULT, R8);
+  // Fill in the frame so vm_call can find this function's registers.  The
+  // function's address is looked up each time, vm programs can move.
+  emit_memory(j, 0, TRUE, 0x8b, RAX, PROGRAM,
+              offsetof(vm_program_t, functions));
+  emit_bytes(j, 2, 0x48, 0x05); // add rax, imm32
+  emit_u32(j, function * sizeof(vm_function_t));
+  emit_memory(j, 0, TRUE, 0x89, RAX, FRAME, offsetof(vm_frame_t, function));
+  emit_memory(j, 0, TRUE, 0x89, REGISTERS, FRAME,
+              offsetof(vm_frame_t, registers));
+  u32 body = emit_jump(j, CC_ALWAYS);
+
+  u32 set_error = here(j);
+  emit_memory(j, 0, TRUE, 0x89, RAX, VM, offsetof(vm_t, error));
+  j->fail = here(j);
+  emit_bytes(j, 2, 0x31, 0xc0); // xor eax, eax
+  j->epilogue = here(j);
+  emit_leave(j);
+  emit(j, 0xc3); // ret
+
+  j->out_of_fuel = here(j);
+  emit_mov_immediate(j, RAX, (u64) "Out of fuel");
+  emit_jump_to(j, CC_ALWAYS, set_error);
+  j->division_by_zero = here(j);
+  emit_mov_immediate(j, RAX, (u64) "Integer division by zero");
+  emit_jump_to(j, CC_ALWAYS, set_error);
+  j->division_overflow = here(j);
+  emit_mov_immediate(j, RAX, (u64) "Integer overflow in division");
+  emit_jump_to(j, CC_ALWAYS, set_error);
+
+  patch_jump(j, body, here(j));
+  j->body = here(j);
+}
+
+static void emit_return(jit_t *j) {
+  emit_bytes(j, 5, 0xb8, 0x01, 0x00, 0x00, 0x00); // mov eax, TRUE
+  emit_jump_to(j, CC_ALWAYS, j->epilogue);
+}
+
+static void emit_instruction(jit_t *j, const u8 **ip) {
+#define OPERAND() bytecode_read_operand(ip)
+#define TARGET() bytecode_read_target(ip)
+  u8 opcode = *(*ip)++;
+  switch (opcode) {
+  case ADD_I64:
+  case SUB_I64:
+  case MUL_I64: {
+    static const u16 opcodes[] = {0x03, 0x2b, 0x0faf}; // add, sub, imul
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    emit_int_binary(j, opcodes[opcode - ADD_I64], dst, a, b);
+    break;
+  }
+  case DIV_I64:
+  case MOD_I64: {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    emit_division(j, opcode == MOD_I64, dst, a, b);
+    break;
+  }
+  case ADD_F64:
+  case SUB_F64:
+  case MUL_F64:
+  case DIV_F64: {
+    static const u16 opcodes[] = {0x0f58, 0x0f5c, 0x0f59, 0x0f5e};
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    emit_float_binary(j, opcodes[opcode - ADD_F64], dst, a, b);
+    break;
+  }
+  case EQ_I64:
+  case NE_I64:
+  case GT_I64:
+  case GTE_I64:
+  case LT_I64:
+  case LTE_I64: {
+    static const u8 conditions[] = {CC_E, CC_NE, CC_G, CC_GE, CC_L, CC_LE};
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    emit_int_compare(j, conditions[opcode - EQ_I64], dst, a, b);
+    break;
+  }
+  case EQ_F64:
+  case NE_F64:
+  case GT_F64:
+  case GTE_F64:
+  case LT_F64:
+  case LTE_F64: {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    emit_float_compare(j, opcode, dst, a, b);
+    break;
+  }
+  case I64_TO_F64: {
+    u32 dst = OPERAND(), src = OPERAND();
+    // cvtsi2sd xmm0, qword [src]
+    emit_memory(j, 0xf2, TRUE, 0x0f2a, 0, REGISTERS, value_of(src));
+    emit_memory(j, 0xf2, FALSE, 0x0f11, 0, REGISTERS, value_of(dst));
+    emit_set_type(j, REGISTERS, type_of(dst), IKA_FLOAT);
+    break;
+  }
+  case MOV: {
+    u32 dst = OPERAND(), src = OPERAND();
+    emit_copy(j, REGISTERS, slot_of(dst), REGISTERS, slot_of(src));
+    break;
+  }
+  case LOAD: {
+    u32 dst = OPERAND(), k = OPERAND();
+    emit_constant(j, dst, k);
+    break;
+  }
+  case JUMP:
+    emit_taken_jump(j, TARGET());
+    break;
+  case JUMP_IF_FALSE: {
+    u32 cond = OPERAND(), target = TARGET();
+    emit_memory(j, 0, TRUE, 0x83, 7, REGISTERS, value_of(cond)); // cmp
+    emit(j, 0);
+    u32 skip = emit_jump(j, CC_NE);
+    emit_taken_jump(j, target);
+    patch_jump(j, skip, here(j));
+    break;
+  }
+  case CALL: {
+    u32 dst = OPERAND(), function = OPERAND();
+    u32 first_arg = OPERAND();
+    OPERAND(); // The argument count is the callee's parameter count
+    emit_call_function(j, dst, function, first_arg);
+    break;
+  }
+  case TAIL_CALL: {
+    u32 function = OPERAND(), first_arg = OPERAND();
+    OPERAND(); // As for CALL
+    emit_tail_call(j, function, first_arg);
+    break;
+  }
+  case PRINT: {
+    u32 src = OPERAND();
+    emit_memory(j, 0, TRUE, 0x8d, RDI, REGISTERS, slot_of(src)); // lea
+    emit_call(j, (u64)vm_print);
+    break;
+  }
+  case RETURN: {
+    u32 src = OPERAND();
+    emit_copy(j, RESULT, 0, REGISTERS, slot_of(src));
+    emit_return(j);
+    break;
+  }
+  case EOP:
+    emit_set_type(j, RESULT, offsetof(ika_value, type), IKA_NONE);
+    emit_bytes(j, 2, 0x31, 0xc0); // xor eax, eax
+    emit_memory(j, 0, TRUE, 0x89, RAX, RESULT, offsetof(ika_value, value));
+    emit_return(j);
+    break;
+  case LT_I64_JUMP_IF_FALSE: {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND(), target = TARGET();
+    emit_int_compare(j, CC_L, dst, a, b);
+    u32 skip = emit_jump(j, CC_L);
+    emit_taken_jump(j, target);
+    patch_jump(j, skip, here(j));
+    break;
+  }
+  case ADD_I64_JUMP: {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND(), target = TARGET();
+    emit_int_binary(j, 0x03, dst, a, b);
+    emit_taken_jump(j, target);
+    break;
+  }
+  case LOAD_ADD_I64:
+  case LOAD_SUB_I64: {
+    u32 tmp = OPERAND(), k = OPERAND(), dst = OPERAND(), a = OPERAND();
+    emit_constant(j, tmp, k);
+    emit_int_binary(j, opcode == LOAD_ADD_I64 ? 0x03 : 0x2b, dst, a, tmp);
+    break;
+  }
+  default:
+    ASSERT_MSG((FALSE), "Unknown opcode in verified bytecode");
+  }
+#undef OPERAND
+#undef TARGET
+}
+
+// Each mapping starts with its size, so jit_free can unmap it.  The code
+// follows, 16 byte aligned.
+#define JIT_HEADER_SIZE 16
+
+vm_native_t jit_compile(vm_program_t *program, u32 function) {
+  vm_function_t *fn = &program->functions[function];
+  // Keeps every register within a 32 bit displacement
+  if (fn->register_count > VM_STACK_SIZE)
+    return NULL;
+
+  jit_t j = {.program = program,
+             .fn = fn,
+             .da_code = darray_init(u8),
+             .offsets = imust_alloc(sizeof(u32) * fn->code_size),
+             .da_fixups = darray_init(jit_fixup_t)};
+  emit_prologue(&j, function);
+  const u8 *ip = fn->code;
+  while (ip < fn->code + fn->code_size) {
+    j.offsets[ip - fn->code] = here(&j);
+    emit_instruction(&j, &ip);
+  }
+  for (u32 i = 0; i < darray_len(j.da_fixups); i++)
+    patch_jump(&j, j.da_fixups[i].at, j.offsets[j.da_fixups[i].target]);
+
+  // Written while the pages are writable, then they're flipped to
+  // executable so they're never both.
+  u64 size = JIT_HEADER_SIZE + here(&j);
+  u8 *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  vm_native_t native = NULL;
+  if (memory != MAP_FAILED) {
+    memcpy(memory, &size, sizeof(size));
+    memcpy(memory + JIT_HEADER_SIZE, j.da_code, here(&j));
+    // ISO C has no cast from an object to a function pointer
+    u8 *code = memory + JIT_HEADER_SIZE;
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0)
+      memcpy(&native, &code, sizeof(native));
+    else
+      munmap(memory, size);
+  }
+  ifree(j.offsets);
+  darray_deinit(j.da_code);
+  darray_deinit(j.da_fixups);
+  return native;
+}
+
+void jit_free(vm_native_t native) {
+  u8 *code;
+  memcpy(&code, &native, sizeof(code));
+  u8 *memory = code - JIT_HEADER_SIZE;
+  u64 size;
+  memcpy(&size, memory, sizeof(size));
+  munmap(memory, size);
+}
+
+#endif
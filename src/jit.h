@@ -0,0 +1,42 @@
+#pragma once
+
+#include "defines.h"
+#include "vm.h"
+
+// Baseline x86-64 JIT
+//
+// Each instruction of a hot function is translated on its own into a fixed
+// template of machine code, with no register allocation: vm registers stay
+// in memory, in the same frame layout the interpreter uses, so compiled and
+// interpreted functions can call each other freely.  Compiled code burns
+// fuel and reports runtime errors exactly like the interpreter.
+//
+// A compiled function is called as
+//
+//   native(vm, program, frame, registers, result)
+//
+// with its arguments already in registers and frame the slot it occupies on
+// the frame stack.  It returns FALSE and sets vm->error on a runtime error,
+// otherwise it stores what it returns in *result.
+
+// Translates a verified function into native code in freshly mapped
+// executable pages.  Returns NULL if it can't.
+vm_native_t jit_compile(vm_program_t *, u32 function);
+
+// Unmaps code jit_compile returned
+void jit_free(vm_native_t);
+
+// The parts of the vm compiled code calls back into, see vm.c
+
+// Calls function from the function running in frame, passing the registers
+// starting at first_arg as its arguments, and stores what it returns in
+// *result.
+b8 vm_call(vm_t *, vm_program_t *, vm_frame_t *frame, u32 function,
+           u32 first_arg, ika_value *result);
+
+// Makes a tail call from the function running in frame, which the callee
+// takes over along with its registers.
+b8 vm_tail_call(vm_t *, vm_program_t *, vm_frame_t *frame, u32 function,
+                u32 first_arg, ika_value *result);
+
+void vm_print(const ika_value *);
@@ -156,11 +156,11 @@ static ast_node_t *parse_fn_call(parser_state_t *state) {
   if (token->type == TOKEN_SYMBOL) {
     ast_node_t *symbol = parse_symbol(state);
     if (expect_and_consume(state, TOKEN_PAREN_OPEN)) {
-      da_nodes *exprs = darray_init(ast_node_t);
+      ast_node_list_t exprs = {0};
       do {
         ast_node_t *expr = parse_expr(state);
         if (expr)
-          darray_append(exprs, *expr);
+          small_vec_append(exprs, expr);
       } while (expect_and_consume(state, TOKEN_COMMA));
       if (expect_and_consume(state, TOKEN_PAREN_CLOSE)) {
         ast_node_t *node = make_node();
@@ -378,6 +378,7 @@ static ast_node_t *parse_assignment(parser_state_t *state) {
       symbol_table_entry_t *var =
           symbol_table_lookup(state->current_scope, symbol->symbol.value);
       if (var) {
+        symbol->symbol.entry = var;
         ast_node_t *node = make_node();
         node->starting_token = token;
         node->line = token->position.line;
@@ -434,7 +435,6 @@ static ast_node_t *parse_block(parser_state_t *state) {
     node->type = ast_block;
     node->line = token->position.line;
     node->column = token->position.line;
-    node->block.nodes = darray_init(ast_node_t);
     node->block.symbol_table = child_symbol_table;
     advance_token_pointer(state); // Move past opening brace
     while (get_token(state)->type != TOKEN_BRACE_CLOSE) {
@@ -443,7 +443,7 @@ static ast_node_t *parse_block(parser_state_t *state) {
         if (child_node->type == ast_return) {
           node->block.return_statement = child_node;
         } else if (!node->block.return_statement) {
-          darray_append(node->block.nodes, *child_node);
+          small_vec_append(node->block.nodes, child_node);
         } else {
           parse_error(state, child_node->starting_token->position.line,
                       child_node->starting_token->position.column,
@@ -470,7 +470,7 @@ static ast_node_t *parse_fn(parser_state_t *state) {
     advance_token_pointer(state);
     ast_node_t *symbol = parse_symbol(state);
     if (symbol) {
-      da_nodes *decls = darray_init(ast_node_t);
+      ast_node_list_t decls = {0};
       e_token_type return_type = TOKEN_VOID;
       if (expect_and_consume(state, TOKEN_PAREN_OPEN)) {
         // Function parameters are in their own scope
@@ -479,7 +479,7 @@ static ast_node_t *parse_fn(parser_state_t *state) {
         do {
           ast_node_t *decl = parse_decl(state);
           if (decl)
-            darray_append(decls, *decl);
+            small_vec_append(decls, decl);
         } while (expect_and_consume(state, TOKEN_COMMA));
 
         if (expect_and_consume(state, TOKEN_PAREN_CLOSE)) {
@@ -642,13 +642,11 @@ ast_node_t *parser_parse(da_tokens *tokens, da_syntax_errors *errors) {
   root->column = root->starting_token->position.line;
   root->type = ast_block;
   root->block.symbol_table = symbol_table;
-  da_nodes *child_nodes = darray_init(ast_node_t);
   while (parser_state.current_token < darray_info(parser_state.tokens)->count) {
     ast_node_t *node = parse_node(&parser_state);
     // Node parsing can return null in cases like comments, etc/
     if (node)
-      darray_append(child_nodes, *node);
+      small_vec_append(root->block.nodes, node);
   }
-  root->block.nodes = child_nodes;
   return root;
 }
@@ -40,10 +40,10 @@ void print_node_as_sexpr(ast_node_t *node) {
     printf("%s", node->symbol.value);
   } else if (node->type == ast_fn_call) {
     printf("(%s ", node->fn_call.symbol->symbol.value);
-    for (uint32_t i = 0; i < darray_len(node->fn_call.exprs); i++) {
-      ast_node_t *expr = &node->fn_call.exprs[i];
+    for (uint32_t i = 0; i < small_vec_len(node->fn_call.exprs); i++) {
+      ast_node_t *expr = small_vec_get(node->fn_call.exprs, i);
       print_node_as_sexpr(expr);
-      if (i < darray_len(node->fn_call.exprs) - 1)
+      if (i < small_vec_len(node->fn_call.exprs) - 1)
         printf(", ");
     }
     printf(")");
@@ -99,12 +99,12 @@ void print_node_as_tree(ast_node_t *node, uint32_t indent_level) {
     ast_node_t *identifier = node->fn.symbol;
     printf("%s", identifier->symbol.value);
     printf("(");
-    for (int i = 0; i < darray_len(node->fn.parameters); i++) {
-      ast_node_t *decl_node = &node->fn.parameters[i];
+    for (int i = 0; i < small_vec_len(node->fn.parameters); i++) {
+      ast_node_t *decl_node = small_vec_get(node->fn.parameters, i);
       identifier = decl_node->decl.symbol;
       printf("%s:%s", identifier->symbol.value,
              token_as_char[decl_node->decl.type]);
-      if (i < darray_len(node->fn.parameters) - 1)
+      if (i < small_vec_len(node->fn.parameters) - 1)
         printf(", ");
     }
     printf(") returns ");
@@ -125,9 +125,8 @@ void print_node_as_tree(ast_node_t *node, uint32_t indent_level) {
   case ast_block: {
     print_indent(indent_level);
     printf("%lc%lc%lc\n", 0x2514, 0x2500, 0x2510);
-    for (u64 i = 0; i < darray_len(node->block.nodes); i++) {
-      da_nodes *head = node->block.nodes;
-      ast_node_t *child = &head[i];
+    for (u64 i = 0; i < small_vec_len(node->block.nodes); i++) {
+      ast_node_t *child = small_vec_get(node->block.nodes, i);
       print_node_as_tree(child, indent_level + 1);
     }
     if (node->block.return_statement) {
@@ -143,10 +142,10 @@ void print_node_as_tree(ast_node_t *node, uint32_t indent_level) {
     printf("%lc ", 0x251c);
     ast_node_t *identifier = node->fn_call.symbol;
     printf("call fn '%s' ", identifier->symbol.value);
-    if (darray_len(node->fn_call.exprs) == 0) {
+    if (small_vec_len(node->fn_call.exprs) == 0) {
       printf("passing no parameters");
     } else {
-      printf("passing (%li) parameters", darray_len(node->fn_call.exprs));
+      printf("passing (%u) parameters", small_vec_len(node->fn_call.exprs));
     }
     printf("\n");
     break;
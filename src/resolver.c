@@ -0,0 +1,79 @@
+#include "resolver.h"
+#include "symbol_table.h"
+
+static void resolve_node(symbol_table_t *, ast_node_t *);
+
+static void bind(symbol_table_t *scope, ast_node_t *symbol) {
+  // The parser binds assignment targets already, when it checks they exist
+  if (!symbol->symbol.entry)
+    symbol->symbol.entry = symbol_table_lookup(scope, symbol->symbol.value);
+}
+
+static void resolve_block(ast_node_t *node) {
+  block_t *block = &node->block;
+  for (u32 i = 0; i < small_vec_len(block->nodes); i++)
+    resolve_node(block->symbol_table, small_vec_get(block->nodes, i));
+  resolve_node(block->symbol_table, block->return_statement);
+}
+
+// Blocks resolve in their own scope, everything else in the scope of the
+// block it's in
+static void resolve_node(symbol_table_t *scope, ast_node_t *node) {
+  if (!node)
+    return;
+  switch (node->type) {
+  case ast_symbol:
+    bind(scope, node);
+    break;
+  case ast_expr:
+    resolve_node(scope, node->expr.left);
+    resolve_node(scope, node->expr.right);
+    break;
+  case ast_term:
+    resolve_node(scope, node->term.left);
+    resolve_node(scope, node->term.right);
+    break;
+  case ast_assignment:
+    bind(scope, node->assignment.symbol);
+    resolve_node(scope, node->assignment.expr);
+    break;
+  case ast_print_stmt:
+    resolve_node(scope, node->print_stmt.expr);
+    break;
+  case ast_if_stmt:
+    resolve_node(scope, node->if_stmt.expr);
+    resolve_node(scope, node->if_stmt.if_block);
+    resolve_node(scope, node->if_stmt.else_block);
+    break;
+  case ast_block:
+    resolve_block(node);
+    break;
+  case ast_fn:
+    bind(scope, node->fn.symbol);
+    for (u32 i = 0; i < small_vec_len(node->fn.parameters); i++) {
+      resolve_node(node->fn.parameters_symbol_table,
+                   small_vec_get(node->fn.parameters, i));
+    }
+    resolve_node(scope, node->fn.block);
+    break;
+  case ast_fn_call:
+    bind(scope, node->fn_call.symbol);
+    for (u32 i = 0; i < small_vec_len(node->fn_call.exprs); i++)
+      resolve_node(scope, small_vec_get(node->fn_call.exprs, i));
+    break;
+  case ast_decl:
+    bind(scope, node->decl.symbol);
+    resolve_node(scope, node->decl.expr);
+    break;
+  case ast_return:
+    resolve_node(scope, node->returns.expr);
+    break;
+  case ast_int_literal:
+  case ast_float_literal:
+  case ast_str_literal:
+  case ast_bool_literal:
+    break;
+  }
+}
+
+void resolver_bind(ast_node_t *root) { resolve_block(root); }
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "ast.h"
+
+// Name resolution
+//
+// Binds every symbol node, including the ones naming a called function, to
+// the symbol table entry it refers to, looking each up once from the scope
+// it appears in.  Later passes go straight to symbol.entry instead of
+// hashing the name and walking the scope chain again.  An undefined name is
+// left bound to NULL, for the typechecker to report.
+void resolver_bind(ast_node_t *root);
@@ -41,28 +41,40 @@ b8 i_dynamic_array_deinit(void *array) {
   return TRUE;
 }
 
+// Resizes the storage so it can hold exactly `capacity` elements.  The
+// allocator grows the block in place when the array is its most recent
+// allocation, otherwise the header and existing entries are copied.
+static dynamic_array_t *i_dynamic_array_resize(dynamic_array_t *stats,
+                                               u64 capacity) {
+  u64 current_size =
+      sizeof(dynamic_array_t) + (stats->capacity * stats->element_size);
+  u64 new_size = sizeof(dynamic_array_t) + (capacity * stats->element_size);
+  stats = imust_realloc(stats, current_size, new_size);
+  stats->capacity = capacity;
+  return stats;
+}
+
+// Makes sure there is room for at least `required` elements.  Capacity grows
+// geometrically (doubling, but never by less than the chunk size) so building
+// up an array of n elements only copies O(n) elements in total.
+static dynamic_array_t *i_dynamic_array_grow(dynamic_array_t *stats,
+                                             u64 required) {
+  if (required <= stats->capacity)
+    return stats;
+  u64 capacity = stats->capacity * 2;
+  if (capacity < stats->capacity + stats->chunk_size)
+    capacity = stats->capacity + stats->chunk_size;
+  if (capacity < required)
+    capacity = required;
+  return i_dynamic_array_resize(stats, capacity);
+}
+
 // Adds a copy of the element parameter to the end of the array
 void *i_dynamic_array_append(void *array, void *element) {
   dynamic_array_t *stats = i_dynamic_array_info(array);
   if (stats->count >= stats->capacity) {
-    // When we run out of capacity, we allocate addition space based on current
-    // usage plus our default chunk size.  We then copy the from the old
-    // storage to the new storage.
-    u64 bytes_to_allocate =
-        sizeof(dynamic_array_t) +
-        ((stats->capacity + stats->chunk_size) * stats->element_size);
-    u64 bytes_to_copy = stats->capacity * stats->element_size;
-    void *previous_storage = array;
-    int8_t *new_loc = imust_alloc(bytes_to_allocate);
-    // Copy stats header
-    memcpy(new_loc, stats, sizeof(dynamic_array_t));
-    // Copy existing array entries
-    void *resized_array = (void *)(new_loc + sizeof(dynamic_array_t));
-    memcpy(resized_array, previous_storage, bytes_to_copy);
-    // Get stats pointer to the new array
-    stats = i_dynamic_array_info(resized_array);
-    stats->capacity += stats->chunk_size;
-    array = resized_array;
+    stats = i_dynamic_array_grow(stats, stats->count + 1);
+    array = (void *)(stats + 1);
   }
   int8_t *storage_location =
       ((int8_t *)array + (stats->element_size * stats->count));
@@ -71,6 +83,37 @@ void *i_dynamic_array_append(void *array, void *element) {
   return array;
 }
 
+// Adds copies of `count` contiguous elements to the end of the array, growing
+// the storage at most once.
+void *i_dynamic_array_append_n(void *array, void *elements, u64 count) {
+  dynamic_array_t *stats = i_dynamic_array_info(array);
+  stats = i_dynamic_array_grow(stats, stats->count + count);
+  array = (void *)(stats + 1);
+  memcpy((int8_t *)array + (stats->element_size * stats->count), elements,
+         stats->element_size * count);
+  stats->count += count;
+  return array;
+}
+
+// Ensures the array can hold `capacity` elements without growing again.
+void *i_dynamic_array_reserve(void *array, u64 capacity) {
+  dynamic_array_t *stats = i_dynamic_array_info(array);
+  if (capacity > stats->capacity) {
+    stats = i_dynamic_array_resize(stats, capacity);
+  }
+  return (void *)(stats + 1);
+}
+
+// Trims the capacity down to the current count.  Memory is only handed back
+// when the array is the allocator's most recent allocation.
+void *i_dynamic_array_shrink(void *array) {
+  dynamic_array_t *stats = i_dynamic_array_info(array);
+  if (stats->count < stats->capacity) {
+    stats = i_dynamic_array_resize(stats, stats->count);
+  }
+  return (void *)(stats + 1);
+}
+
 // Returns a pointer to the element in the array.  You must cast the pointer
 // to the appropriate type.
 void *i_dynamic_array_get_ref(void *array, u64 slot) {
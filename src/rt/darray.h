@@ -11,7 +11,7 @@ typedef struct {
   u32 element_size;
   u64 capacity;
   u64 count;
-  // How many elements to allocate at once.
+  // The minimum number of elements to grow by.
   u32 chunk_size;
 } dynamic_array_t;
 
@@ -22,6 +22,9 @@ dynamic_array_t *i_dynamic_array_info(void *array);
 b8 i_dynamic_array_get(void *array, uint64_t slot, void *element);
 void *i_dynamic_array_get_ref(void *array, u64 slot);
 void *i_dynamic_array_append(void *array, void *element);
+void *i_dynamic_array_append_n(void *array, void *elements, u64 count);
+void *i_dynamic_array_reserve(void *array, u64 capacity);
+void *i_dynamic_array_shrink(void *array);
 b8 i_dynamic_array_put(void *array, uint64_t slot, void *element_ptr);
 void *i_dynamic_array_push(void *array, void *element_ptr);
 b8 i_dynamic_array_pop(void *array, void *element);
@@ -33,6 +36,11 @@ b8 i_dynamic_array_pop(void *array, void *element);
     __typeof__(value) temp = value;                                            \
     array = i_dynamic_array_append(array, &temp);                              \
   }
+#define darray_append_n(array, elements, count)                                \
+  array = i_dynamic_array_append_n(array, elements, count)
+#define darray_reserve(array, capacity)                                        \
+  array = i_dynamic_array_reserve(array, capacity)
+#define darray_shrink(array) array = i_dynamic_array_shrink(array)
 #define darray_get(array, slot) i_dynamic_array_get(array, slot)
 #define darray_info(array) i_dynamic_array_info(array)
 #define darray_put(array, slot, element)                                       \
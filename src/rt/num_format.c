@@ -0,0 +1,325 @@
+#include "num_format.h"
+
+#include <math.h>
+#include <string.h>
+
+u32 num_format_i64(char *buffer, i64 value) {
+  char digits[NUM_FORMAT_I64_MAX_LENGTH];
+  u32 count = 0;
+  u32 length = 0;
+  // Negate as unsigned so INT64_MIN doesn't overflow
+  u64 magnitude = value < 0 ? (u64)0 - (u64)value : (u64)value;
+  do {
+    digits[count++] = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0)
+    buffer[length++] = '-';
+  while (count > 0)
+    buffer[length++] = digits[--count];
+  return length;
+}
+
+// Round trip double formatting using Florian Loitsch's Grisu2 algorithm,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers"
+// (2010).  Its output always reads back exactly but isn't always the
+// shortest possible.  The structure follows Milo Yip's well known
+// implementation.
+//
+// A diy_fp is an unbounded "do it yourself" floating point number, f * 2^e.
+typedef struct {
+  u64 f;
+  i32 e;
+} diy_fp_t;
+
+#define DOUBLE_SIGNIFICAND_SIZE 52
+#define DOUBLE_EXPONENT_BIAS (0x3FF + DOUBLE_SIGNIFICAND_SIZE)
+#define DOUBLE_MIN_EXPONENT (-DOUBLE_EXPONENT_BIAS)
+#define DOUBLE_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DOUBLE_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DOUBLE_HIDDEN_BIT 0x0010000000000000ULL
+
+// Normalized 64 bit approximations of 10^k for k = -348, -340, ..., 340,
+// rounded to nearest, along with their binary exponents.
+static const u64 cached_powers_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const i16 cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635,
+    -608, -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316,
+    -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30, 56,
+    83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853,
+    880, 907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const u64 pow10_u64[] = {1ULL,
+                                10ULL,
+                                100ULL,
+                                1000ULL,
+                                10000ULL,
+                                100000ULL,
+                                1000000ULL,
+                                10000000ULL,
+                                100000000ULL,
+                                1000000000ULL,
+                                10000000000ULL,
+                                100000000000ULL,
+                                1000000000000ULL,
+                                10000000000000ULL,
+                                100000000000000ULL,
+                                1000000000000000ULL,
+                                10000000000000000ULL,
+                                100000000000000000ULL,
+                                1000000000000000000ULL,
+                                10000000000000000000ULL};
+
+static diy_fp_t diy_fp_from_double(f64 value) {
+  u64 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  i32 biased_e = (i32)((bits & DOUBLE_EXPONENT_MASK) >> DOUBLE_SIGNIFICAND_SIZE);
+  u64 significand = bits & DOUBLE_SIGNIFICAND_MASK;
+  if (biased_e != 0) {
+    return (diy_fp_t){.f = significand + DOUBLE_HIDDEN_BIT,
+                      .e = biased_e - DOUBLE_EXPONENT_BIAS};
+  }
+  return (diy_fp_t){.f = significand, .e = DOUBLE_MIN_EXPONENT + 1};
+}
+
+static diy_fp_t diy_fp_sub(diy_fp_t a, diy_fp_t b) {
+  return (diy_fp_t){.f = a.f - b.f, .e = a.e};
+}
+
+// 64x64 bit multiply keeping the rounded upper 64 bits
+static diy_fp_t diy_fp_mul(diy_fp_t x, diy_fp_t y) {
+  const u64 mask_32 = 0xFFFFFFFFULL;
+  u64 a = x.f >> 32, b = x.f & mask_32;
+  u64 c = y.f >> 32, d = y.f & mask_32;
+  u64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  u64 tmp = (bd >> 32) + (ad & mask_32) + (bc & mask_32);
+  tmp += 1ULL << 31; // Round
+  return (diy_fp_t){.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+                    .e = x.e + y.e + 64};
+}
+
+static diy_fp_t diy_fp_normalize(diy_fp_t v) {
+  while (!(v.f & DOUBLE_HIDDEN_BIT)) {
+    v.f <<= 1;
+    v.e--;
+  }
+  v.f <<= (64 - DOUBLE_SIGNIFICAND_SIZE - 1);
+  v.e -= (64 - DOUBLE_SIGNIFICAND_SIZE - 1);
+  return v;
+}
+
+static diy_fp_t diy_fp_normalize_boundary(diy_fp_t v) {
+  while (!(v.f & (DOUBLE_HIDDEN_BIT << 1))) {
+    v.f <<= 1;
+    v.e--;
+  }
+  v.f <<= (64 - DOUBLE_SIGNIFICAND_SIZE - 2);
+  v.e -= (64 - DOUBLE_SIGNIFICAND_SIZE - 2);
+  return v;
+}
+
+// The boundaries m- and m+ are halfway to the neighbouring doubles, any
+// number between them reads back as v.
+static void diy_fp_normalized_boundaries(diy_fp_t v, diy_fp_t *minus,
+                                         diy_fp_t *plus) {
+  diy_fp_t pl =
+      diy_fp_normalize_boundary((diy_fp_t){.f = (v.f << 1) + 1, .e = v.e - 1});
+  diy_fp_t mi = v.f == DOUBLE_HIDDEN_BIT
+                    ? (diy_fp_t){.f = (v.f << 2) - 1, .e = v.e - 2}
+                    : (diy_fp_t){.f = (v.f << 1) - 1, .e = v.e - 1};
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  *plus = pl;
+  *minus = mi;
+}
+
+static diy_fp_t cached_power(i32 e, i32 *k) {
+  // dk must be positive, so can do ceiling in positive
+  f64 dk = (-61 - e) * 0.30102999566398114 + 347;
+  i32 ik = (i32)dk;
+  if (dk - ik > 0.0)
+    ik++;
+  u32 index = (u32)((ik >> 3) + 1);
+  *k = -(-348 + (i32)(index << 3)); // decimal exponent no need lookup table
+  return (diy_fp_t){.f = cached_powers_f[index], .e = cached_powers_e[index]};
+}
+
+static u32 count_decimal_digits_32(u32 n) {
+  u32 digits = 1;
+  while (digits < 10 && n >= pow10_u64[digits])
+    digits++;
+  return digits;
+}
+
+static void grisu_round(char *buffer, u32 length, u64 delta, u64 rest,
+                        u64 ten_kappa, u64 wp_w) {
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buffer[length - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+static void digit_gen(diy_fp_t w, diy_fp_t mp, u64 delta, char *buffer,
+                      u32 *length, i32 *k) {
+  diy_fp_t one = {.f = 1ULL << -mp.e, .e = mp.e};
+  diy_fp_t wp_w = diy_fp_sub(mp, w);
+  u32 p1 = (u32)(mp.f >> -one.e);
+  u64 p2 = mp.f & (one.f - 1);
+  i32 kappa = (i32)count_decimal_digits_32(p1);
+  *length = 0;
+
+  // Integral digits
+  while (kappa > 0) {
+    u32 d = (u32)(p1 / pow10_u64[kappa - 1]);
+    p1 %= (u32)pow10_u64[kappa - 1];
+    if (d || *length)
+      buffer[(*length)++] = (char)('0' + d);
+    kappa--;
+    u64 tmp = ((u64)p1 << -one.e) + p2;
+    if (tmp <= delta) {
+      *k += kappa;
+      grisu_round(buffer, *length, delta, tmp, pow10_u64[kappa] << -one.e,
+                  wp_w.f);
+      return;
+    }
+  }
+
+  // Fractional digits
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || *length)
+      buffer[(*length)++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      i32 index = -kappa;
+      grisu_round(buffer, *length, delta, p2, one.f,
+                  wp_w.f * (index < 20 ? pow10_u64[index] : 0));
+      return;
+    }
+  }
+}
+
+// Produces the digits of a positive, finite, non zero double.  The value is
+// digits * 10^k.
+static void grisu2(f64 value, char *buffer, u32 *length, i32 *k) {
+  diy_fp_t v = diy_fp_from_double(value);
+  diy_fp_t w_m, w_p;
+  diy_fp_normalized_boundaries(v, &w_m, &w_p);
+
+  diy_fp_t c_mk = cached_power(w_p.e, k);
+  diy_fp_t w = diy_fp_mul(diy_fp_normalize(v), c_mk);
+  diy_fp_t wp = diy_fp_mul(w_p, c_mk);
+  diy_fp_t wm = diy_fp_mul(w_m, c_mk);
+  wm.f++;
+  wp.f--;
+  digit_gen(w, wp, wp.f - wm.f, buffer, length, k);
+}
+
+static u32 write_exponent(char *buffer, i32 k) {
+  u32 length = 0;
+  if (k < 0) {
+    buffer[length++] = '-';
+    k = -k;
+  }
+  return length + num_format_i64(&buffer[length], k);
+}
+
+// Lays the digits out as a decimal number, switching to exponent notation
+// for very large and very small magnitudes.
+static u32 prettify(char *buffer, u32 length, i32 k) {
+  i32 kk = (i32)length + k; // 10^(kk-1) <= v < 10^kk
+  if (k >= 0 && kk <= 21) {
+    // 1234e7 -> 12340000000.0
+    memset(&buffer[length], '0', k);
+    buffer[kk] = '.';
+    buffer[kk + 1] = '0';
+    return kk + 2;
+  } else if (0 < kk && kk <= 21) {
+    // 1234e-2 -> 12.34
+    memmove(&buffer[kk + 1], &buffer[kk], length - kk);
+    buffer[kk] = '.';
+    return length + 1;
+  } else if (-6 < kk && kk <= 0) {
+    // 1234e-6 -> 0.001234
+    i32 offset = 2 - kk;
+    memmove(&buffer[offset], &buffer[0], length);
+    buffer[0] = '0';
+    buffer[1] = '.';
+    memset(&buffer[2], '0', offset - 2);
+    return length + offset;
+  } else if (length == 1) {
+    // 1e30
+    buffer[1] = 'e';
+    return 2 + write_exponent(&buffer[2], kk - 1);
+  } else {
+    // 1234e30 -> 1.234e33
+    memmove(&buffer[2], &buffer[1], length - 1);
+    buffer[1] = '.';
+    buffer[length + 1] = 'e';
+    return length + 2 + write_exponent(&buffer[length + 2], kk - 1);
+  }
+}
+
+u32 num_format_f64(char *buffer, f64 value) {
+  u32 length = 0;
+  if (value != value) {
+    memcpy(buffer, "nan", 3);
+    return 3;
+  }
+  // signbit rather than < 0, so -0.0 keeps its sign
+  if (signbit(value)) {
+    buffer[length++] = '-';
+    value = -value;
+  }
+  if (value == 0.0) {
+    memcpy(&buffer[length], "0.0", 3);
+    return length + 3;
+  }
+  if (value > 1.7976931348623157e308) {
+    memcpy(&buffer[length], "inf", 3);
+    return length + 3;
+  }
+  u32 digits = 0;
+  i32 k = 0;
+  grisu2(value, &buffer[length], &digits, &k);
+  return length + prettify(&buffer[length], digits, k);
+}
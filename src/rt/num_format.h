@@ -0,0 +1,17 @@
+#pragma once
+
+#include "../defines.h"
+
+// Largest number of characters num_format_i64 and num_format_f64 will write.
+#define NUM_FORMAT_I64_MAX_LENGTH 20
+#define NUM_FORMAT_F64_MAX_LENGTH 32
+
+// Number formatting without going through printf.  Both write into a
+// caller supplied buffer (no trailing \0) and return the length written.
+u32 num_format_i64(char *buffer, i64 value);
+
+// Writes a decimal representation that reads back as exactly the same
+// double.  It's the shortest one for almost every value, Grisu2 gives up to
+// a digit more for a small fraction of them.  The result always contains a
+// '.' or an exponent, so it is also a valid C floating point literal.
+u32 num_format_f64(char *buffer, f64 value);
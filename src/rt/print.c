@@ -1,11 +1,94 @@
 #include "print.h"
+#include "num_format.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-void _ika_print_int(i64 v) { printf("%li", v); }
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
 
-void _ika_print_float(f64 v) { printf("%f", v); }
+// Everything printed is gathered here and written out in one go when the
+// buffer fills, when the program exits or when ika_print_flush is called.
+// Programs are single threaded so there is no locking.
+static char print_buffer[PRINT_BUFFER_SIZE];
+static u32 print_buffer_used = 0;
 
-void _ika_print_bool(b8 v) { printf("%s", v == 0 ? "false" : "true"); }
+// Set up on the first print.  A terminal sees each line as soon as it's
+// complete, anything else (files, pipes) only gets full buffers.
+static b8 print_initialized = FALSE;
+static b8 print_line_buffered = FALSE;
 
-void _ika_print_str(str v) { printf("%.*s", (int)v.length, v.ptr); }
+static void print_write(const char *data, u64 length) {
+#ifndef _WIN32
+  while (length > 0) {
+    ssize_t written = write(STDOUT_FILENO, data, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return; // Nowhere left to report it
+    }
+    data += written;
+    length -= written;
+  }
+#else
+  fwrite(data, 1, length, stdout);
+  fflush(stdout);
+#endif
+}
+
+void ika_print_flush(void) {
+  if (print_buffer_used == 0)
+    return;
+  print_write(print_buffer, print_buffer_used);
+  print_buffer_used = 0;
+}
+
+static void print_initialize() {
+  print_initialized = TRUE;
+#ifndef _WIN32
+  print_line_buffered = isatty(STDOUT_FILENO);
+#endif
+  atexit(ika_print_flush);
+}
+
+static void print_append(const char *data, u64 length) {
+  if (!print_initialized)
+    print_initialize();
+  if (print_buffer_used + length > PRINT_BUFFER_SIZE) {
+    ika_print_flush();
+    if (length >= PRINT_BUFFER_SIZE) {
+      print_write(data, length);
+      return;
+    }
+  }
+  memcpy(&print_buffer[print_buffer_used], data, length);
+  print_buffer_used += length;
+}
+
+void _ika_print_int(i64 v) {
+  char buffer[NUM_FORMAT_I64_MAX_LENGTH];
+  print_append(buffer, num_format_i64(buffer, v));
+}
+
+void _ika_print_float(f64 v) {
+  char buffer[NUM_FORMAT_F64_MAX_LENGTH];
+  print_append(buffer, num_format_f64(buffer, v));
+}
+
+void _ika_print_bool(b8 v) {
+  if (v == 0)
+    print_append("false", 5);
+  else
+    print_append("true", 4);
+}
+
+void _ika_print_str(str v) {
+  u64 length = str_len(v);
+  const char *chars = str_ptr(&v);
+  print_append(chars, length);
+  if (print_line_buffered && memchr(chars, '\n', length) != NULL)
+    ika_print_flush();
+}
@@ -4,6 +4,13 @@
 
 #include "str.h"
 
+// Output is buffered, see print.c
+#define PRINT_BUFFER_SIZE (16 * 1024)
+
+// Writes out anything still buffered.  Also runs at exit, call it before
+// handing stdout to anything else.
+void ika_print_flush(void);
+
 void _ika_print_int(i64);
 void _ika_print_float(f64);
 void _ika_print_bool(b8);
@@ -0,0 +1,28 @@
+#include "small_vec.h"
+
+#include <string.h>
+
+// Elements are stored inline until the inline capacity is used up, then
+// everything is moved to a heap block which grows geometrically from there.
+void i_small_vec_append(small_vec_header_t *header, void *inline_items,
+                        u32 inline_capacity, u32 element_size, void *element) {
+  b8 is_inline = header->capacity <= inline_capacity;
+  u32 capacity = is_inline ? inline_capacity : header->capacity;
+  if (header->count >= capacity) {
+    u32 new_capacity = capacity * 2;
+    if (is_inline) {
+      void *heap = imust_alloc((u64)new_capacity * element_size);
+      memcpy(heap, inline_items, (u64)header->count * element_size);
+      header->heap = heap;
+    } else {
+      header->heap =
+          imust_realloc(header->heap, (u64)capacity * element_size,
+                        (u64)new_capacity * element_size);
+    }
+    header->capacity = new_capacity;
+    is_inline = FALSE;
+  }
+  int8_t *items = is_inline ? inline_items : header->heap;
+  memcpy(items + ((u64)element_size * header->count), element, element_size);
+  header->count += 1;
+}
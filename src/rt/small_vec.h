@@ -0,0 +1,44 @@
+#pragma once
+
+#include "../../lib/allocator.h"
+#include "../defines.h"
+
+// Small vector with inline storage for the first N elements.  Anything past
+// that spills over to the heap.  A zeroed small vector is a valid empty one,
+// so it can be embedded directly in structures allocated with imust_alloc.
+//
+// Declare a concrete type with:
+//
+//   typedef small_vec(ast_node_t *, 4) ast_node_list_t;
+//
+typedef struct {
+  u32 count;
+  // Zero (or the inline capacity) while the elements live inline.
+  u32 capacity;
+  void *heap;
+} small_vec_header_t;
+
+#define small_vec(type, n)                                                     \
+  struct {                                                                     \
+    small_vec_header_t header;                                                 \
+    type items[n];                                                             \
+  }
+
+void i_small_vec_append(small_vec_header_t *header, void *inline_items,
+                        u32 inline_capacity, u32 element_size, void *element);
+
+#define small_vec_inline_capacity(vec)                                         \
+  (sizeof((vec).items) / sizeof((vec).items[0]))
+#define small_vec_is_inline(vec)                                               \
+  ((vec).header.capacity <= small_vec_inline_capacity(vec))
+#define small_vec_items(vec)                                                   \
+  (small_vec_is_inline(vec) ? (vec).items                                      \
+                            : (__typeof__(&(vec).items[0]))(vec).header.heap)
+#define small_vec_len(vec) (vec).header.count
+#define small_vec_get(vec, slot) small_vec_items(vec)[slot]
+#define small_vec_append(vec, value)                                           \
+  {                                                                            \
+    __typeof__((vec).items[0]) temp = value;                                   \
+    i_small_vec_append(&(vec).header, (vec).items,                             \
+                       small_vec_inline_capacity(vec), sizeof(temp), &temp);   \
+  }
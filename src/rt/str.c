@@ -6,92 +6,268 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Use the SSE2 kernels below where the target has them, everything else
+// falls back to the C library.  Build with -DSTR_NO_SIMD to use the C
+// library everywhere.
+#ifndef STR_NO_SIMD
+#define STR_USE_SIMD
+#endif
+
+#if defined(STR_USE_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define STR_SSE2
+#define STR_VECTOR_SIZE 16
+#endif
+
+// Scanning for the end of a C string reads whole aligned vectors, which can
+// run past the terminator (but never into the next page).  That is fine for
+// the hardware but not for the address sanitizer.
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define STR_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef STR_NO_SANITIZE
+#if defined(__SANITIZE_ADDRESS__)
+#define STR_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define STR_NO_SANITIZE
+#endif
+#endif
+
+#ifdef STR_SSE2
+// Bit i is set when byte i of the two vectors match
+static inline u32 str_vector_eq_mask(const char *a, const char *b) {
+  __m128i va = _mm_loadu_si128((const __m128i *)a);
+  __m128i vb = _mm_loadu_si128((const __m128i *)b);
+  return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+}
+#endif
+
+// Compares length bytes, the tail is covered with overlapping loads rather
+// than a byte loop so short identifiers stay cheap.
+static b8 str_bytes_eq(const char *a, const char *b, u64 length) {
+#ifdef STR_SSE2
+  if (length >= STR_VECTOR_SIZE) {
+    u64 i = 0;
+    for (; i + STR_VECTOR_SIZE <= length; i += STR_VECTOR_SIZE) {
+      if (str_vector_eq_mask(&a[i], &b[i]) != 0xFFFF)
+        return FALSE;
+    }
+    if (i == length)
+      return TRUE;
+    u64 last = length - STR_VECTOR_SIZE;
+    return str_vector_eq_mask(&a[last], &b[last]) == 0xFFFF;
+  }
+  if (length >= 8) {
+    u64 a1, a2, b1, b2;
+    memcpy(&a1, a, 8);
+    memcpy(&b1, b, 8);
+    memcpy(&a2, &a[length - 8], 8);
+    memcpy(&b2, &b[length - 8], 8);
+    return ((a1 ^ b1) | (a2 ^ b2)) == 0;
+  }
+  if (length >= 4) {
+    u32 a1, a2, b1, b2;
+    memcpy(&a1, a, 4);
+    memcpy(&b1, b, 4);
+    memcpy(&a2, &a[length - 4], 4);
+    memcpy(&b2, &b[length - 4], 4);
+    return ((a1 ^ b1) | (a2 ^ b2)) == 0;
+  }
+  for (u64 i = 0; i < length; i++) {
+    if (a[i] != b[i])
+      return FALSE;
+  }
+  return TRUE;
+#else
+  return memcmp(a, b, length) == 0;
+#endif
+}
+
+STR_NO_SANITIZE static u64 str_cstr_length(const char *chars) {
+#ifdef STR_SSE2
+  // Aligned loads never cross into an unmapped page
+  u64 misalignment = (uintptr_t)chars & (STR_VECTOR_SIZE - 1);
+  const char *block = chars - misalignment;
+  __m128i zero = _mm_setzero_si128();
+  u32 mask = (u32)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)block), zero));
+  mask &= 0xFFFFu << misalignment; // Ignore bytes before the string
+  while (mask == 0) {
+    block += STR_VECTOR_SIZE;
+    mask = (u32)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)block), zero));
+  }
+  return (u64)(block - chars) + __builtin_ctz(mask);
+#else
+  return strlen(chars);
+#endif
+}
+
+// memchr over a str, returns the index of the first ch at or after start.
+static i64 str_scan_for_char(str s, char ch, u64 start) {
+  const char *chars = str_ptr(&s);
+  u64 length = str_len(s);
+#ifdef STR_SSE2
+  __m128i wanted = _mm_set1_epi8(ch);
+  u64 i = start;
+  for (; i + STR_VECTOR_SIZE <= length; i += STR_VECTOR_SIZE) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)&chars[i]);
+    u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, wanted));
+    if (mask)
+      return (i64)(i + __builtin_ctz(mask));
+  }
+  for (; i < length; i++) {
+    if (chars[i] == ch)
+      return (i64)i;
+  }
+  return -1;
+#else
+  if (start >= length)
+    return -1;
+  const char *found = memchr(&chars[start], ch, length - start);
+  return found ? (i64)(found - chars) : -1;
+#endif
+}
+
+// Finds the first occurrence of needle at or after start.  The SSE2 version
+// tests 16 candidate positions at once by matching both the first and last
+// byte of the needle, only positions where both agree get a full compare.
+static i64 str_search(str haystack, str needle, u64 start) {
+  const char *hay = str_ptr(&haystack);
+  const char *ndl = str_ptr(&needle);
+  u64 hay_length = str_len(haystack);
+  u64 ndl_length = str_len(needle);
+  if (ndl_length == 0)
+    return start <= hay_length ? (i64)start : -1;
+  if (start > hay_length || ndl_length > hay_length - start)
+    return -1;
+  u64 last_candidate = hay_length - ndl_length;
+  u64 i = start;
+#ifdef STR_SSE2
+  if (ndl_length > 1) {
+    __m128i first = _mm_set1_epi8(ndl[0]);
+    __m128i last = _mm_set1_epi8(ndl[ndl_length - 1]);
+    for (; i + STR_VECTOR_SIZE - 1 <= last_candidate; i += STR_VECTOR_SIZE) {
+      __m128i block_first = _mm_loadu_si128((const __m128i *)&hay[i]);
+      __m128i block_last = _mm_loadu_si128(
+          (const __m128i *)&hay[i + ndl_length - 1]);
+      u32 mask = (u32)_mm_movemask_epi8(
+          _mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                        _mm_cmpeq_epi8(block_last, last)));
+      while (mask) {
+        u32 bit = __builtin_ctz(mask);
+        if (str_bytes_eq(&hay[i + bit + 1], &ndl[1],
+                         ndl_length - 2))
+          return (i64)(i + bit);
+        mask &= mask - 1;
+      }
+    }
+  }
+#endif
+  while (i <= last_candidate) {
+    i64 found = str_scan_for_char(haystack, ndl[0], i);
+    if (found == -1 || (u64)found > last_candidate)
+      return -1;
+    if (str_bytes_eq(&hay[found], ndl, ndl_length))
+      return found;
+    i = (u64)found + 1;
+  }
+  return -1;
+}
+
+// Builds an inline string, unused bytes are zeroed so that two inline strings
+// are equal exactly when all their bytes are.
+static str str_inline(const char *chars, u64 length) {
+  str s = {0};
+  memcpy(s.chars, chars, length);
+  s.chars[15] = (char)(STR_INLINE_TAG | length);
+  return s;
+}
+
 str str_new(const char *c_chars, u64 length) {
+#ifdef STR_USE_SSO
+  if (length <= STR_INLINE_CAPACITY)
+    return str_inline(c_chars, length);
+#endif
   char *new_storage = imust_alloc(length);
   memcpy(new_storage, c_chars, length);
   return (str){.ptr = new_storage, .length = length};
 }
 
 str cstr(const char *raw_chars) {
-  uint32_t length = 0;
-  while (raw_chars[length] != '\0')
-    length++;
-  return (str){.ptr = raw_chars, .length = length};
+  return (str){.ptr = raw_chars, .length = str_cstr_length(raw_chars)};
 }
 
 str cstr_from_char_with_length(const char *raw_chars, uint32_t length) {
   return (str){.ptr = raw_chars, .length = (uint32_t)length};
 }
 
-u64 str_len(str s) { return s.length; }
-
 b8 str_eq(str s1, str s2) {
-  if (s1.length != s2.length)
+  if (str_is_inline(&s1) && str_is_inline(&s2))
+    return memcmp(s1.chars, s2.chars, sizeof(s1.chars)) == 0;
+  u64 length = str_len(s1);
+  if (length != str_len(s2))
     return FALSE;
-  for (u64 i = 0; i < s1.length; i++) {
-    if (s1.ptr[i] != s2.ptr[i])
-      return FALSE;
-  }
-  return TRUE;
+  const char *p1 = str_ptr(&s1);
+  const char *p2 = str_ptr(&s2);
+  if (p1 == p2)
+    return TRUE;
+  return str_bytes_eq(p1, p2, length);
 }
 
 str str_substr(str s, u64 starting_idx, u64 length) {
+  // A view into an inline string would point into our copy of it
+  if (str_is_inline(&s))
+    return str_inline(&s.chars[starting_idx], length);
   return (str){.ptr = &s.ptr[starting_idx], .length = length};
 }
 
 str str_substr_copy(str s, u64 starting_idx, u64 length) {
-  void *mem = imust_alloc(sizeof(uint8_t) * length);
-  memcpy(mem, &s.ptr[starting_idx], length);
-  return (str){.ptr = mem, .length = length};
+  return str_new(&str_ptr(&s)[starting_idx], length);
 }
 
 void str_copy(str src, str *dest) {
-  char *copy = imust_alloc(sizeof(char) * src.length);
-  memcpy(copy, src.ptr, src.length);
-  dest->ptr = copy;
-  dest->length = src.length;
+  *dest = str_new(str_ptr(&src), str_len(src));
 }
 
 char str_get_char(str s, u64 pos) {
-  if (pos < s.length) {
-    return s.ptr[pos];
+  if (pos < str_len(s)) {
+    return str_ptr(&s)[pos];
   }
   return 0;
 }
 
 b8 str_matches_at_index(str haystack, str needle, u64 position) {
-  if (position + needle.length > haystack.length) {
+  if (position + str_len(needle) > str_len(haystack)) {
     return FALSE;
   }
-  for (int i = 0; i < needle.length; i++) {
-    if (haystack.ptr[position + i] != needle.ptr[i]) {
-      return FALSE;
-    }
-  }
-  return TRUE;
+  return str_bytes_eq(&str_ptr(&haystack)[position], str_ptr(&needle),
+                      str_len(needle));
 }
 
+i64 str_idx_of_char(str s, char ch) { return str_scan_for_char(s, ch, 0); }
+
 i64 str_find_idx_of_nth(u32 nth, str haystack, str needle) {
-  u32 match = 0;
-  for (u64 i = 0; i < haystack.length; i++) {
-    if (haystack.ptr[i] == needle.ptr[0]) {
-      if (str_eq(str_substr(haystack, i, needle.length), needle)) {
-        if (match == nth - 1) {
-          return (int)i;
-        } else {
-          match++;
-        }
-      }
-    }
+  i64 found = -1;
+  for (u32 match = 0; match < nth; match++) {
+    // Matches may overlap, so carry on from just past the last one
+    found = str_search(haystack, needle, (u64)(found + 1));
+    if (found == -1)
+      return -1;
   }
-  return -1;
+  return found;
 }
 
 b8 str_contains(str haystack, str needle) {
-  return str_find_idx_of_nth(1, haystack, needle) != -1;
+  return str_search(haystack, needle, 0) != -1;
 }
 
 char *str_to_cstr(str value) {
-  char *new_str = imust_alloc(value.length + 1); // Add room for the trailing \0
-  return strncpy(new_str, (char *)value.ptr, value.length);
+  u64 length = str_len(value);
+  char *new_str = imust_alloc(length + 1); // Add room for the trailing \0
+  memcpy(new_str, str_ptr(&value), length);
+  new_str[length] = '\0';
+  return new_str;
 }
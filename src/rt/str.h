@@ -3,19 +3,60 @@
 #include "../../lib/allocator.h"
 #include "../defines.h"
 
+// Strings up to STR_INLINE_CAPACITY bytes that the str functions create
+// (str_new, str_copy, str_substr_copy, ...) are stored inside the str itself
+// rather than in a separate allocation.  The last byte doubles as the tag,
+// it's the top byte of length for pointer strings so it can never have the
+// high bit set there.  Relies on a little endian layout.  Comment out to
+// disable
+#define STR_USE_SSO
+
+#if defined(STR_USE_SSO) && defined(__BYTE_ORDER__) &&                         \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define STR_INLINE_CAPACITY 15
+#else
+#undef STR_USE_SSO
+#define STR_INLINE_CAPACITY 0
+#endif
+
+#define STR_INLINE_TAG 0x80
+
+// Views (cstr, str_substr of a pointer string, ...) always point at their
+// characters.  Read strings through str_ptr and str_len, ptr and length are
+// only meaningful for the pointer form.
 typedef struct str {
-  u64 length;
-  const char *ptr;
+  union {
+    struct {
+      const char *ptr;
+      u64 length;
+    };
+    char chars[16];
+  };
 } str;
 
+static inline b8 str_is_inline(const str *s) {
+#ifdef STR_USE_SSO
+  return ((u8)s->chars[15] & STR_INLINE_TAG) != 0;
+#else
+  return FALSE;
+#endif
+}
+
+// For inline strings this points into *s, so it's only valid as long as s is
+static inline const char *str_ptr(const str *s) {
+  return str_is_inline(s) ? s->chars : s->ptr;
+}
+
+static inline u64 str_len(str s) {
+  return str_is_inline(&s) ? (u8)s.chars[15] & ~STR_INLINE_TAG : s.length;
+}
+
 str str_new(const char *, u64 length);
 
 str cstr(const char *);
 
 str cstr_from_char_with_length(const char *, u32);
 
-u64 str_len(str);
-
 b8 str_eq(str, str);
 
 char str_get_char(str, u64);
@@ -28,6 +69,8 @@ void str_copy(str src, str *dest);
 
 b8 str_matches_at_index(str, str, u64);
 
+i64 str_idx_of_char(str, char);
+
 i64 str_find_idx_of_nth(u32, str, str);
 
 b8 str_contains(str, str);
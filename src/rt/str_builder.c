@@ -2,57 +2,60 @@
 #include "../../lib/allocator.h"
 
 #include "darray.h"
+#include "num_format.h"
 #include "str.h"
 #include "str_builder.h"
-#include <stdio.h>
 #include <string.h>
 
+// Starting size of the buffer, the backends build whole files with one builder.
+#define STR_BUILDER_INITIAL_CAPACITY 4096
+
 str_builder_t *str_builder_init() {
   str_builder_t *builder = imust_alloc(sizeof(str_builder_t));
-  builder->da_strs = darray_init(str);
+  builder->da_chars = darray_init(char);
+  darray_reserve(builder->da_chars, STR_BUILDER_INITIAL_CAPACITY);
   return builder;
 }
 
 str_builder_t *str_builder_append_str(str_builder_t *sb, str s) {
-  darray_append(sb->da_strs, s);
-  return sb; // TODO: Update darray append to return bool
+  darray_append_n(sb->da_chars, (void *)str_ptr(&s), str_len(s));
+  return sb;
 }
 
 str_builder_t *str_builder_append_char_ptr(str_builder_t *sb, const char *cp) {
-  return str_builder_append_str(sb, cstr(cp));
+  darray_append_n(sb->da_chars, (void *)cp, strlen(cp));
+  return sb;
 }
 
 str_builder_t *str_builder_append_char(str_builder_t *sb, const char ch) {
-  char *buff = imust_alloc(2);
-  snprintf(buff, 2, "%c", ch);
-  return str_builder_append_str(sb, cstr(buff));
+  darray_append(sb->da_chars, (char)ch);
+  return sb;
 }
 
 str_builder_t *str_builder_append_i64(str_builder_t *sb, i64 n) {
-  char *buff = imust_alloc(20 + 1);
-  snprintf(buff, 21, "%li", n);
-  return str_builder_append_str(sb, cstr(buff));
+  char buffer[NUM_FORMAT_I64_MAX_LENGTH];
+  darray_append_n(sb->da_chars, buffer, num_format_i64(buffer, n));
+  return sb;
 }
 
 str_builder_t *str_builder_append_f64(str_builder_t *sb, f64 n) {
-  // https://stackoverflow.com/questions/56514892/how-many-digits-can-float8-float16-float32-float64-and-float128-contain
-  char *buff = imust_alloc(15 + 1);
-  snprintf(buff, 16, "%lf", n);
-  return str_builder_append_str(sb, cstr(buff));
+  char buffer[NUM_FORMAT_F64_MAX_LENGTH];
+  darray_append_n(sb->da_chars, buffer, num_format_f64(buffer, n));
+  return sb;
+}
+
+u64 str_builder_len(str_builder_t *sb) { return darray_len(sb->da_chars); }
+
+str str_builder_view(str_builder_t *sb) {
+  return (str){.ptr = sb->da_chars, .length = darray_len(sb->da_chars)};
+}
+
+void str_builder_clear(str_builder_t *sb) {
+  darray_info(sb->da_chars)->count = 0;
 }
 
 str str_builder_to_alloced_str(str_builder_t *sb) {
-  u64 total_length = 0;
-  for (int i = 0; i < darray_len(sb->da_strs); i++) {
-    total_length += sb->da_strs[i].length;
-  }
-  char *buffer = imust_alloc(total_length);
-  char *copy_pointer = buffer;
-  for (int i = 0; i < darray_len(sb->da_strs); i++) {
-    memcpy(copy_pointer, sb->da_strs[i].ptr, sb->da_strs[i].length);
-    copy_pointer += sb->da_strs[i].length;
-  }
-  return (str){.ptr = (const char *)buffer, .length = total_length};
-}
-
-void str_builder_cleanup(str_builder_t *sb) { darray_deinit(sb->da_strs); }
+  return str_new(sb->da_chars, darray_len(sb->da_chars));
+}
+
+void str_builder_cleanup(str_builder_t *sb) { darray_deinit(sb->da_chars); }
@@ -2,8 +2,10 @@
 
 #include "str.h"
 
+// Appends are copied straight into a single growable buffer, so building a
+// string doesn't allocate per piece and producing the result is one copy.
 typedef struct str_builder_t {
-  str *da_strs;
+  char *da_chars;
 } str_builder_t;
 
 str_builder_t *str_builder_init();
@@ -12,6 +14,11 @@ str_builder_t *str_builder_append_i64(str_builder_t *, i64);
 str_builder_t *str_builder_append_f64(str_builder_t *, f64);
 str_builder_t *str_builder_append_char(str_builder_t *, char);
 str_builder_t *str_builder_append_char_ptr(str_builder_t *, const char *);
+u64 str_builder_len(str_builder_t *);
+// The contents without copying, only valid until the next append or clear.
+str str_builder_view(str_builder_t *);
+// Empties the builder but keeps its buffer for reuse.
+void str_builder_clear(str_builder_t *);
 str str_builder_to_alloced_str(str_builder_t *);
 void str_builder_cleanup(str_builder_t *);
 
@@ -0,0 +1,112 @@
+// Rough timings for the rt/str primitives.  Build from the repo root with
+//
+//   clang -O2 -std=c11 -o str_bench src/tests/str_bench.c src/rt/str.c \
+//     lib/allocator.c lib/log.c
+//
+// Short identifiers stand in for what the compiler compares while looking up
+// symbols, the long strings for what compiled programs search at runtime.
+
+#include "../../lib/allocator.h"
+#include "../rt/str.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SHORT_ITERATIONS 20000000
+#define LONG_ITERATIONS 20000
+#define LONG_LENGTH (64 * 1024)
+
+static u64 time_in_ns() {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void report(const char *name, u64 start, u64 iterations, u64 bytes) {
+  u64 elapsed = time_in_ns() - start;
+  printf("%-32s %8.2f ns/op", name, (double)elapsed / iterations);
+  if (bytes)
+    printf(" %8.2f GB/s", (double)bytes * iterations / elapsed);
+  printf("\n");
+}
+
+// Keeps the compiler from optimising the calls away
+static volatile u64 sink;
+
+static void bench_short_identifiers() {
+  const char *names[] = {"i", "x", "count", "index", "tokenizer_scan",
+                         "symbol_table_lookup", "check_fn_call",
+                         "determine_type_for_expression"};
+  u32 name_count = sizeof(names) / sizeof(names[0]);
+  str strs[sizeof(names) / sizeof(names[0])];
+  str copies[sizeof(names) / sizeof(names[0])];
+  for (u32 i = 0; i < name_count; i++) {
+    strs[i] = cstr(names[i]);
+    str_copy(strs[i], &copies[i]);
+  }
+
+  u64 start = time_in_ns();
+  for (u64 i = 0; i < SHORT_ITERATIONS; i++)
+    sink += cstr(names[i % name_count]).length;
+  report("cstr (identifiers)", start, SHORT_ITERATIONS, 0);
+
+  start = time_in_ns();
+  for (u64 i = 0; i < SHORT_ITERATIONS; i++)
+    sink += str_eq(strs[i % name_count], copies[i % name_count]);
+  report("str_eq (identifiers)", start, SHORT_ITERATIONS, 0);
+
+  start = time_in_ns();
+  for (u64 i = 0; i < SHORT_ITERATIONS; i++)
+    sink += str_contains(strs[i % name_count], cstr("_for"));
+  report("str_contains (identifiers)", start, SHORT_ITERATIONS, 0);
+}
+
+static void bench_long_strings() {
+  char *text = imust_alloc(LONG_LENGTH + 1);
+  char *copy = imust_alloc(LONG_LENGTH + 1);
+  // Plenty of near misses for the search to wade through
+  for (u64 i = 0; i < LONG_LENGTH; i++)
+    text[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+  memcpy(&text[LONG_LENGTH - 16], "needle in a hays", 16);
+  memcpy(copy, text, LONG_LENGTH + 1);
+  str haystack = cstr(text);
+  str same = cstr(copy);
+
+  u64 start = time_in_ns();
+  for (u64 i = 0; i < LONG_ITERATIONS; i++)
+    sink += cstr(text).length;
+  report("cstr (64 KiB)", start, LONG_ITERATIONS, LONG_LENGTH);
+
+  start = time_in_ns();
+  for (u64 i = 0; i < LONG_ITERATIONS; i++)
+    sink += str_eq(haystack, same);
+  report("str_eq (64 KiB)", start, LONG_ITERATIONS, LONG_LENGTH);
+
+  start = time_in_ns();
+  for (u64 i = 0; i < LONG_ITERATIONS; i++)
+    sink += str_idx_of_char(haystack, '!');
+  report("str_idx_of_char (64 KiB, miss)", start, LONG_ITERATIONS,
+         LONG_LENGTH);
+
+  start = time_in_ns();
+  for (u64 i = 0; i < LONG_ITERATIONS; i++)
+    sink += str_contains(haystack, cstr("needle"));
+  report("str_contains (64 KiB)", start, LONG_ITERATIONS, LONG_LENGTH);
+
+  start = time_in_ns();
+  for (u64 i = 0; i < LONG_ITERATIONS; i++)
+    sink += str_find_idx_of_nth(100, haystack, cstr("lazy dog"));
+  report("str_find_idx_of_nth (n=100)", start, LONG_ITERATIONS, 0);
+}
+
+int main(int argc, char **argv) {
+  if (!initialize_allocator()) {
+    printf("Couldn't initialize allocator\n");
+    return 1;
+  }
+  bench_short_identifiers();
+  bench_long_strings();
+  shutdown_allocator();
+  return 0;
+}
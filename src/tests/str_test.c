@@ -0,0 +1,261 @@
+// Checks the rt/str primitives against byte at a time versions.  Build from
+// the repo root with
+//
+//   clang -O2 -std=c11 -o str_test src/tests/str_test.c src/rt/str.c \
+//     lib/allocator.c lib/log.c
+//
+// and again with -DSTR_NO_SIMD to check the C library fallbacks.  Prints
+// what didn't match and exits with 1 if anything didn't.
+//
+// Every string under test ends right before an unreadable page, so a kernel
+// that reads past the end of its string crashes instead of passing by luck.
+// Lengths run past four vectors, which covers the 15 byte inline limit and
+// every tail a vector loop can leave.
+
+// MAP_ANONYMOUS isn't POSIX, glibc only declares it under -std=c11 if asked
+#define _DEFAULT_SOURCE
+
+#include "../../lib/allocator.h"
+#include "../rt/str.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAX_LENGTH 70
+#define MAX_NEEDLE_LENGTH 20
+#define SEARCHES_PER_LENGTH 16
+
+static u64 checks;
+static u64 failures;
+
+static void check(b8 ok, const char *what, u64 length, i64 detail) {
+  checks++;
+  if (ok)
+    return;
+  failures++;
+  printf("FAIL %s (length %lu, %li)\n", what, (unsigned long)length,
+         (long)detail);
+}
+
+// A readable page followed by one that isn't
+typedef struct guarded_t {
+  char *end;
+} guarded_t;
+
+static guarded_t guarded_new() {
+  long page = sysconf(_SC_PAGESIZE);
+  char *memory = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED || mprotect(memory + page, page, PROT_NONE)) {
+    printf("Couldn't map a guard page\n");
+    exit(1);
+  }
+  return (guarded_t){.end = memory + page};
+}
+
+// Copies length bytes so they end pad bytes before the guard page
+static char *place(guarded_t g, const char *chars, u64 length, u64 pad) {
+  char *at = g.end - pad - length;
+  memcpy(at, chars, length);
+  memset(g.end - pad, 'x', pad);
+  return at;
+}
+
+static b8 same_bytes(str s, const char *chars, u64 length) {
+  return str_len(s) == length && memcmp(str_ptr(&s), chars, length) == 0;
+}
+
+static i64 reference_search(const char *hay, u64 hay_length, const char *ndl,
+                            u64 ndl_length, u64 start) {
+  for (u64 i = start; i + ndl_length <= hay_length; i++) {
+    if (memcmp(&hay[i], ndl, ndl_length) == 0)
+      return (i64)i;
+  }
+  return -1;
+}
+
+static i64 reference_nth(u32 nth, const char *hay, u64 hay_length,
+                         const char *ndl, u64 ndl_length) {
+  i64 found = -1;
+  for (u32 match = 0; match < nth; match++) {
+    found = reference_search(hay, hay_length, ndl, ndl_length,
+                             (u64)(found + 1));
+    if (found == -1)
+      return -1;
+  }
+  return found;
+}
+
+// Mostly two letters, so needles match often and overlap
+static void random_text(char *chars, u64 length) {
+  for (u64 i = 0; i < length; i++)
+    chars[i] = "aab"[rand() % 3];
+}
+
+static void test_cstr(guarded_t g) {
+  char text[MAX_LENGTH + 1];
+  for (u64 length = 0; length <= MAX_LENGTH; length++) {
+    memset(text, 'q', length);
+    text[length] = '\0';
+    // Every misalignment of the terminator against a vector
+    for (u64 pad = 0; pad < 16; pad++) {
+      str s = cstr(place(g, text, length + 1, pad));
+      check(str_len(s) == length, "cstr length", length, (i64)pad);
+    }
+  }
+}
+
+static void test_new_and_copy(guarded_t g) {
+  char text[MAX_LENGTH];
+  for (u64 length = 0; length <= MAX_LENGTH; length++) {
+    random_text(text, length);
+    char *chars = place(g, text, length, 0);
+    str s = str_new(chars, length);
+    check(same_bytes(s, text, length), "str_new", length, 0);
+    check(str_is_inline(&s) == (length <= STR_INLINE_CAPACITY),
+          "str_new inline", length, 0);
+    str copy;
+    str_copy(s, &copy);
+    check(same_bytes(copy, text, length), "str_copy", length, 0);
+    char *c_chars = str_to_cstr(s);
+    check(strlen(c_chars) == length && memcmp(c_chars, text, length) == 0,
+          "str_to_cstr", length, 0);
+    for (u64 pos = 0; pos <= length + 1; pos++) {
+      char expected = pos < length ? text[pos] : 0;
+      check(str_get_char(s, pos) == expected, "str_get_char", length,
+            (i64)pos);
+    }
+    // Substrings that start and end everywhere, of views and owned strings
+    str view = cstr_from_char_with_length(chars, (u32)length);
+    for (u64 start = 0; start <= length; start++) {
+      u64 sub_length = length - start;
+      check(same_bytes(str_substr(s, start, sub_length), &text[start],
+                       sub_length),
+            "str_substr", length, (i64)start);
+      check(same_bytes(str_substr(view, start, sub_length), &text[start],
+                       sub_length),
+            "str_substr of a view", length, (i64)start);
+      check(same_bytes(str_substr_copy(view, start, sub_length),
+                       &text[start], sub_length),
+            "str_substr_copy", length, (i64)start);
+    }
+  }
+}
+
+static void test_eq(guarded_t g, guarded_t other) {
+  char text[MAX_LENGTH];
+  for (u64 length = 0; length <= MAX_LENGTH; length++) {
+    random_text(text, length);
+    char *a = place(g, text, length, 0);
+    char *b = place(other, text, length, 0);
+    str view_a = cstr_from_char_with_length(a, (u32)length);
+    str view_b = cstr_from_char_with_length(b, (u32)length);
+    str owned_a = str_new(a, length);
+    check(str_eq(view_a, view_b), "str_eq", length, -1);
+    check(str_eq(owned_a, view_b), "str_eq owned and view", length, -1);
+    check(str_eq(view_b, owned_a), "str_eq view and owned", length, -1);
+    if (length > 0) {
+      check(!str_eq(view_a, cstr_from_char_with_length(b, (u32)length - 1)),
+            "str_eq shorter", length, -1);
+    }
+    for (u64 pos = 0; pos < length; pos++) {
+      b[pos] ^= 1;
+      str owned_b = str_new(b, length);
+      check(!str_eq(view_a, view_b), "str_eq differing byte", length,
+            (i64)pos);
+      check(!str_eq(owned_a, owned_b), "str_eq owned differing byte",
+            length, (i64)pos);
+      b[pos] ^= 1;
+    }
+  }
+}
+
+static void test_idx_of_char(guarded_t g) {
+  char text[MAX_LENGTH];
+  for (u64 length = 0; length <= MAX_LENGTH; length++) {
+    random_text(text, length);
+    str absent = cstr_from_char_with_length(place(g, text, length, 0),
+                                            (u32)length);
+    check(str_idx_of_char(absent, 'z') == -1, "str_idx_of_char absent",
+          length, -1);
+    for (u64 pos = 0; pos < length; pos++) {
+      // A second one further on must not be found first
+      text[pos] = 'z';
+      text[length - 1] = 'z';
+      char *chars = place(g, text, length, 0);
+      str view = cstr_from_char_with_length(chars, (u32)length);
+      check(str_idx_of_char(view, 'z') == (i64)pos, "str_idx_of_char",
+            length, (i64)pos);
+      check(str_idx_of_char(str_new(chars, length), 'z') == (i64)pos,
+            "str_idx_of_char owned", length, (i64)pos);
+      text[pos] = 'a';
+      text[length - 1] = 'a';
+    }
+  }
+}
+
+static void test_search(guarded_t g, guarded_t other) {
+  char text[MAX_LENGTH];
+  char needle[MAX_NEEDLE_LENGTH];
+  for (u64 length = 0; length <= MAX_LENGTH; length++) {
+    for (u32 search = 0; search < SEARCHES_PER_LENGTH; search++) {
+      random_text(text, length);
+      u64 ndl_length = (u64)rand() % (MAX_NEEDLE_LENGTH + 1);
+      // Half the needles come from the end of the text, where a vector loop
+      // hands over to its tail
+      if (search % 2 && ndl_length <= length)
+        memcpy(needle, &text[length - ndl_length], ndl_length);
+      else
+        random_text(needle, ndl_length);
+      char *hay = place(g, text, length, 0);
+      char *ndl = place(other, needle, ndl_length, 0);
+      str haystack = cstr_from_char_with_length(hay, (u32)length);
+      str ndl_view = cstr_from_char_with_length(ndl, (u32)ndl_length);
+      str haystacks[] = {haystack, str_new(hay, length)};
+      str needles[] = {ndl_view, str_new(ndl, ndl_length)};
+      for (u32 h = 0; h < 2; h++) {
+        for (u32 n = 0; n < 2; n++) {
+          i64 first = reference_search(text, length, needle, ndl_length, 0);
+          check(str_contains(haystacks[h], needles[n]) == (first != -1),
+                "str_contains", length, (i64)ndl_length);
+          for (u32 nth = 0; nth <= 4; nth++) {
+            i64 expected =
+                reference_nth(nth, text, length, needle, ndl_length);
+            check(str_find_idx_of_nth(nth, haystacks[h], needles[n]) ==
+                      expected,
+                  "str_find_idx_of_nth", length, (i64)ndl_length);
+          }
+          for (u64 pos = 0; pos <= length + 1; pos++) {
+            b8 expected = pos + ndl_length <= length &&
+                          memcmp(&text[pos], needle, ndl_length) == 0;
+            check(str_matches_at_index(haystacks[h], needles[n], pos) ==
+                      expected,
+                  "str_matches_at_index", length, (i64)pos);
+          }
+        }
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  if (!initialize_allocator()) {
+    printf("Couldn't initialize allocator\n");
+    return 1;
+  }
+  srand(1);
+  guarded_t g = guarded_new();
+  guarded_t other = guarded_new();
+  test_cstr(g);
+  test_new_and_copy(g);
+  test_eq(g, other);
+  test_idx_of_char(g);
+  test_search(g, other);
+  printf("%lu checks, %lu failed\n", (unsigned long)checks,
+         (unsigned long)failures);
+  shutdown_allocator();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+// Timings for the bytecode interpreter on arithmetic and call heavy
+// programs.  Build from the repo root with
+//
+//   clang -O2 -std=c11 -o vm_bench src/tests/vm_bench.c src/vm.c \
+//     src/bytecode.c src/jit.c src/rt/darray.c lib/allocator.c \
+//     lib/assert.c lib/log.c
+//
+// and again with -DVM_SWITCH_DISPATCH to compare against switch dispatch,
+// -DVM_NO_SUPERINSTRUCTIONS to compare against unfused bytecode, or
+// -DVM_NO_JIT to compare against interpreting everything.  Each benchmark is
+// a single call, so only fib and sum_to, which calls itself, are hot enough
+// to be compiled.
+
+#include "../../lib/allocator.h"
+#include "../bytecode.h"
+#include "../vm.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define LOOP_ITERATIONS 20000000
+#define FIB_ARGUMENT 30
+#define FLOAT_ITERATIONS 10000000
+#define TAIL_CALL_DEPTH 20000000
+
+static ika_value integer(i64 value) {
+  return (ika_value){.type = IKA_INT, .integer = value};
+}
+
+static ika_value phloat(f64 value) {
+  return (ika_value){.type = IKA_FLOAT, .floating = value};
+}
+
+static e_ika_vm_type int_parameter[] = {IKA_INT};
+static e_ika_vm_type int_parameters[] = {IKA_INT, IKA_INT};
+
+static u32 k(bytecode_builder_t *b, ika_value value) {
+  return bytecode_constant(b, value);
+}
+
+// sum_squares(n): sum of i * i % 7 for i below n
+static vm_function_t build_sum_squares() {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, integer(0))); // sum = 0
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(0))); // i = 0
+  bytecode_emit(&b, LOAD, 2, 3, k(&b, integer(1)));
+  bytecode_emit(&b, LOAD, 2, 4, k(&b, integer(7)));
+  u32 loop = bytecode_position(&b);
+  bytecode_emit(&b, LT_I64, 3, 5, 2, 0); // i < n
+  u32 exit = bytecode_emit_jump(&b, JUMP_IF_FALSE, 5, 0);
+  bytecode_emit(&b, MUL_I64, 3, 6, 2, 2);
+  bytecode_emit(&b, MOD_I64, 3, 6, 6, 4);
+  bytecode_emit(&b, ADD_I64, 3, 1, 1, 6);
+  bytecode_emit(&b, ADD_I64, 3, 2, 2, 3); // i = i + 1
+  bytecode_emit_jump(&b, JUMP, 0, loop);
+  bytecode_patch_jump(&b, exit, bytecode_position(&b));
+  bytecode_emit(&b, RETURN, 1, 1);
+  return bytecode_finish(&b, "sum_squares", 1, int_parameter, IKA_INT, 7);
+}
+
+// fib(n): n < 2 ? n : fib(n - 1) + fib(n - 2)
+static vm_function_t build_fib(u32 self) {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, integer(2)));
+  bytecode_emit(&b, LT_I64, 3, 2, 0, 1);
+  u32 recurse = bytecode_emit_jump(&b, JUMP_IF_FALSE, 2, 0);
+  bytecode_emit(&b, RETURN, 1, 0);
+  bytecode_patch_jump(&b, recurse, bytecode_position(&b));
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, integer(1)));
+  bytecode_emit(&b, SUB_I64, 3, 3, 0, 1);
+  bytecode_emit(&b, CALL, 4, 4, self, 3, 1);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, integer(2)));
+  bytecode_emit(&b, SUB_I64, 3, 3, 0, 1);
+  bytecode_emit(&b, CALL, 4, 5, self, 3, 1);
+  bytecode_emit(&b, ADD_I64, 3, 4, 4, 5);
+  bytecode_emit(&b, RETURN, 1, 4);
+  return bytecode_finish(&b, "fib", 1, int_parameter, IKA_INT, 6);
+}
+
+// integrate(n): left Riemann sum of x * x over [0, n * 1e-7)
+static vm_function_t build_integrate() {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, phloat(0.0))); // area = 0
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(0)));  // i = 0
+  bytecode_emit(&b, LOAD, 2, 3, k(&b, integer(1)));
+  bytecode_emit(&b, LOAD, 2, 5, k(&b, phloat(0.0))); // x = 0
+  bytecode_emit(&b, LOAD, 2, 6, k(&b, phloat(1e-7))); // step
+  u32 loop = bytecode_position(&b);
+  bytecode_emit(&b, LT_I64, 3, 7, 2, 0); // i < n
+  u32 exit = bytecode_emit_jump(&b, JUMP_IF_FALSE, 7, 0);
+  bytecode_emit(&b, MUL_F64, 3, 8, 5, 5);
+  bytecode_emit(&b, MUL_F64, 3, 8, 8, 6);
+  bytecode_emit(&b, ADD_F64, 3, 1, 1, 8);
+  bytecode_emit(&b, ADD_F64, 3, 5, 5, 6);
+  bytecode_emit(&b, ADD_I64, 3, 2, 2, 3);
+  bytecode_emit_jump(&b, JUMP, 0, loop);
+  bytecode_patch_jump(&b, exit, bytecode_position(&b));
+  bytecode_emit(&b, RETURN, 1, 1);
+  return bytecode_finish(&b, "integrate", 1, int_parameter, IKA_FLOAT,
+                         9);
+}
+
+// sum_to(n, acc): n == 0 ? acc : sum_to(n - 1, acc + n), far deeper than
+// the frame stack, so it only runs as a tail call
+static vm_function_t build_sum_to(u32 self) {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(0)));
+  bytecode_emit(&b, EQ_I64, 3, 3, 0, 2);
+  u32 recurse = bytecode_emit_jump(&b, JUMP_IF_FALSE, 3, 0);
+  bytecode_emit(&b, RETURN, 1, 1);
+  bytecode_patch_jump(&b, recurse, bytecode_position(&b));
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(1)));
+  bytecode_emit(&b, SUB_I64, 3, 4, 0, 2);
+  bytecode_emit(&b, ADD_I64, 3, 5, 1, 0);
+  bytecode_emit(&b, TAIL_CALL, 3, self, 4, 2);
+  return bytecode_finish(&b, "sum_to", 2, int_parameters, IKA_INT, 6);
+}
+
+static vm_function_t functions[4];
+
+static u64 time_in_ms() {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void run(vm_t *vm, vm_program_t *program, u32 function, i64 argument) {
+  // A second parameter is an accumulator, which starts at 0
+  ika_value args[] = {integer(argument), integer(0)};
+  ika_value result;
+  u64 start = time_in_ms();
+  if (!vm_execute(vm, program, function, args, &result)) {
+    printf("%-12s failed: %s\n", functions[function].name, vm->error);
+    return;
+  }
+  u64 elapsed = time_in_ms() - start;
+  if (result.type == IKA_FLOAT)
+    printf("%-12s %6lu ms  (result %f)\n", functions[function].name, elapsed,
+           result.floating);
+  else
+    printf("%-12s %6lu ms  (result %li)\n", functions[function].name, elapsed,
+           result.integer);
+}
+
+int main(int argc, char **argv) {
+  if (!initialize_allocator()) {
+    printf("Couldn't initialize allocator\n");
+    return 1;
+  }
+  functions[0] = build_sum_squares();
+  functions[1] = build_fib(1);
+  functions[2] = build_integrate();
+  functions[3] = build_sum_to(3);
+  vm_program_t program = {.functions = functions,
+                          .function_count =
+                              sizeof(functions) / sizeof(functions[0])};
+  vm_t vm;
+  vm_init(&vm);
+  if (!vm_load(&vm, &program)) {
+    printf("%s\n", vm.error);
+    return 1;
+  }
+  run(&vm, &program, 0, LOOP_ITERATIONS);
+  run(&vm, &program, 1, FIB_ARGUMENT);
+  run(&vm, &program, 2, FLOAT_ITERATIONS);
+  run(&vm, &program, 3, TAIL_CALL_DEPTH);
+  shutdown_allocator();
+  return 0;
+}
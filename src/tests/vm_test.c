@@ -0,0 +1,478 @@
+// Checks what the vm computes against the same computations done in C.
+// Build from the repo root with
+//
+//   clang -O2 -std=c11 -o vm_test src/tests/vm_test.c src/vm.c \
+//     src/bytecode.c src/jit.c src/rt/darray.c lib/allocator.c \
+//     lib/assert.c lib/log.c
+//
+// and again with each of -DVM_SWITCH_DISPATCH, -DVM_NO_SUPERINSTRUCTIONS
+// and -DVM_NO_JIT, so every way of running the bytecode is held to the same
+// answers.  Prints what didn't match and exits with 1 if anything didn't.
+//
+// Every check starts the function over with vm_release_function and calls it
+// VM_JIT_THRESHOLD + 2 times, so with the JIT on both the interpreter and the
+// native code are checked.
+
+#include "../../lib/allocator.h"
+#include "../bytecode.h"
+#include "../vm.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CALLS_PER_CHECK (VM_JIT_THRESHOLD + 2)
+#define TAIL_CALL_DEPTH (VM_MAX_FRAMES * 10)
+// Plenty for any check, but a loop that never ends still does
+#define CHECK_FUEL (1000 * 1000)
+
+static u64 checks;
+static u64 failures;
+
+static ika_value integer(i64 value) {
+  return (ika_value){.type = IKA_INT, .integer = value};
+}
+
+static ika_value phloat(f64 value) {
+  return (ika_value){.type = IKA_FLOAT, .floating = value};
+}
+
+static e_ika_vm_type int_parameter[] = {IKA_INT};
+static e_ika_vm_type int_parameters[] = {IKA_INT, IKA_INT};
+static e_ika_vm_type float_parameters[] = {IKA_FLOAT, IKA_FLOAT};
+
+static u32 k(bytecode_builder_t *b, ika_value value) {
+  return bytecode_constant(b, value);
+}
+
+// dst = a op b on the two parameters
+static vm_function_t build_binary(u8 opcode, e_ika_vm_type *parameter_types,
+                                  e_ika_vm_type return_type) {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, opcode, 3, 2, 0, 1);
+  bytecode_emit(&b, RETURN, 1, 2);
+  return bytecode_finish(&b, "binary", 2, parameter_types, return_type, 3);
+}
+
+// sum_squares(n): sum of i * i % 7 for i below n, the loop test and the
+// increment fuse into LT_I64_JUMP_IF_FALSE and ADD_I64_JUMP
+static vm_function_t build_sum_squares() {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, integer(0))); // sum = 0
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(0))); // i = 0
+  bytecode_emit(&b, LOAD, 2, 3, k(&b, integer(1)));
+  bytecode_emit(&b, LOAD, 2, 4, k(&b, integer(7)));
+  u32 loop = bytecode_position(&b);
+  bytecode_emit(&b, LT_I64, 3, 5, 2, 0); // i < n
+  u32 exit = bytecode_emit_jump(&b, JUMP_IF_FALSE, 5, 0);
+  bytecode_emit(&b, MUL_I64, 3, 6, 2, 2);
+  bytecode_emit(&b, MOD_I64, 3, 6, 6, 4);
+  bytecode_emit(&b, ADD_I64, 3, 1, 1, 6);
+  bytecode_emit(&b, ADD_I64, 3, 2, 2, 3); // i = i + 1
+  bytecode_emit_jump(&b, JUMP, 0, loop);
+  bytecode_patch_jump(&b, exit, bytecode_position(&b));
+  bytecode_emit(&b, RETURN, 1, 1);
+  return bytecode_finish(&b, "sum_squares", 1, int_parameter, IKA_INT, 7);
+}
+
+// count_up(n): the same shape of loop, but every pair that could fuse has
+// a jump into its second half, so none may
+static vm_function_t build_count_up() {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, integer(0))); // i = 0
+  bytecode_emit(&b, LT_I64, 3, 2, 1, 0);
+  u32 loop = bytecode_position(&b);
+  u32 exit = bytecode_emit_jump(&b, JUMP_IF_FALSE, 2, 0);
+  bytecode_emit(&b, LOAD, 2, 3, k(&b, integer(1)));
+  u32 add = bytecode_position(&b);
+  bytecode_emit(&b, ADD_I64, 3, 1, 1, 3); // i = i + 1
+  bytecode_emit(&b, LT_I64, 3, 2, 1, 0);
+  bytecode_emit_jump(&b, JUMP, 0, loop);
+  // Never taken, only here to make the ADD_I64 a jump target
+  bytecode_emit_jump(&b, JUMP, 0, add);
+  bytecode_patch_jump(&b, exit, bytecode_position(&b));
+  bytecode_emit(&b, RETURN, 1, 1);
+  return bytecode_finish(&b, "count_up", 1, int_parameter, IKA_INT, 4);
+}
+
+// countdown(n): n > 0 ? countdown(n - 1) + 3 : 0, the constants fuse into
+// LOAD_SUB_I64 and LOAD_ADD_I64
+static vm_function_t build_countdown(u32 self) {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, integer(0)));
+  bytecode_emit(&b, GT_I64, 3, 2, 0, 1);
+  u32 base = bytecode_emit_jump(&b, JUMP_IF_FALSE, 2, 0);
+  bytecode_emit(&b, LOAD, 2, 3, k(&b, integer(1)));
+  bytecode_emit(&b, SUB_I64, 3, 4, 0, 3);
+  bytecode_emit(&b, CALL, 4, 5, self, 4, 1);
+  bytecode_emit(&b, LOAD, 2, 3, k(&b, integer(3)));
+  bytecode_emit(&b, ADD_I64, 3, 5, 5, 3);
+  bytecode_emit(&b, RETURN, 1, 5);
+  bytecode_patch_jump(&b, base, bytecode_position(&b));
+  bytecode_emit(&b, RETURN, 1, 1);
+  return bytecode_finish(&b, "countdown", 1, int_parameter, IKA_INT, 6);
+}
+
+// sum_to(n, acc): n == 0 ? acc : sum_to(n - 1, acc + n), deeper than the
+// frame stack so it only works as a tail call
+static vm_function_t build_sum_to(u32 self) {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(0)));
+  bytecode_emit(&b, EQ_I64, 3, 3, 0, 2);
+  u32 recurse = bytecode_emit_jump(&b, JUMP_IF_FALSE, 3, 0);
+  bytecode_emit(&b, RETURN, 1, 1);
+  bytecode_patch_jump(&b, recurse, bytecode_position(&b));
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(1)));
+  bytecode_emit(&b, SUB_I64, 3, 4, 0, 2);
+  bytecode_emit(&b, ADD_I64, 3, 5, 1, 0);
+  bytecode_emit(&b, TAIL_CALL, 3, self, 4, 2);
+  return bytecode_finish(&b, "sum_to", 2, int_parameters, IKA_INT, 6);
+}
+
+// halves(n): sum of i * 0.5 for i below n, through I64_TO_F64 and MOV
+static vm_function_t build_halves() {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, LOAD, 2, 1, k(&b, phloat(0.0))); // sum = 0
+  bytecode_emit(&b, LOAD, 2, 2, k(&b, integer(0)));  // i = 0
+  bytecode_emit(&b, LOAD, 2, 3, k(&b, integer(1)));
+  bytecode_emit(&b, LOAD, 2, 4, k(&b, phloat(0.5)));
+  u32 loop = bytecode_position(&b);
+  bytecode_emit(&b, LT_I64, 3, 5, 2, 0);
+  u32 exit = bytecode_emit_jump(&b, JUMP_IF_FALSE, 5, 0);
+  bytecode_emit(&b, I64_TO_F64, 2, 6, 2);
+  bytecode_emit(&b, MUL_F64, 3, 6, 6, 4);
+  bytecode_emit(&b, ADD_F64, 3, 1, 1, 6);
+  bytecode_emit(&b, ADD_I64, 3, 2, 2, 3);
+  bytecode_emit_jump(&b, JUMP, 0, loop);
+  bytecode_patch_jump(&b, exit, bytecode_position(&b));
+  bytecode_emit(&b, MOV, 2, 7, 1);
+  bytecode_emit(&b, RETURN, 1, 7);
+  return bytecode_finish(&b, "halves", 1, int_parameter, IKA_FLOAT, 8);
+}
+
+// forever(n): calls itself until the frames run out
+static vm_function_t build_forever(u32 self) {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, CALL, 4, 1, self, 0, 1);
+  bytecode_emit(&b, RETURN, 1, 1);
+  return bytecode_finish(&b, "forever", 1, int_parameter, IKA_INT, 2);
+}
+
+// nothing(n): returns without a value
+static vm_function_t build_nothing() {
+  bytecode_builder_t b;
+  bytecode_builder_init(&b);
+  bytecode_emit(&b, EOP, 0);
+  return bytecode_finish(&b, "nothing", 1, int_parameter, IKA_NONE, 1);
+}
+
+static const u8 int_opcodes[] = {ADD_I64, SUB_I64, MUL_I64, DIV_I64,
+                                 MOD_I64, EQ_I64,  NE_I64,  GT_I64,
+                                 GTE_I64, LT_I64,  LTE_I64};
+static const u8 float_opcodes[] = {ADD_F64, SUB_F64, MUL_F64, DIV_F64,
+                                   EQ_F64,  NE_F64,  GT_F64,  GTE_F64,
+                                   LT_F64,  LTE_F64};
+
+#define INT_OPCODE_COUNT sizeof(int_opcodes)
+#define FLOAT_OPCODE_COUNT sizeof(float_opcodes)
+
+enum {
+  SUM_SQUARES = INT_OPCODE_COUNT + FLOAT_OPCODE_COUNT,
+  COUNT_UP,
+  COUNTDOWN,
+  SUM_TO,
+  HALVES,
+  FOREVER,
+  NOTHING,
+  FUNCTION_COUNT,
+};
+
+static vm_function_t functions[FUNCTION_COUNT];
+
+// What a call should produce: a value, or the error it stops with
+typedef struct expected_t {
+  ika_value value;
+  const char *error;
+} expected_t;
+
+static expected_t value(ika_value value) {
+  return (expected_t){.value = value};
+}
+
+static expected_t error(const char *error) {
+  return (expected_t){.error = error};
+}
+
+// Floats have to match bit for bit, apart from which NaN they are
+static b8 same_value(ika_value a, ika_value b) {
+  if (a.type != b.type)
+    return FALSE;
+  if (a.type == IKA_NONE)
+    return TRUE;
+  if (a.type == IKA_FLOAT && isnan(a.floating))
+    return isnan(b.floating);
+  return a.value == b.value;
+}
+
+static void print_value(ika_value v) {
+  if (v.type == IKA_FLOAT)
+    printf("%.17g", v.floating);
+  else if (v.type == IKA_INT)
+    printf("%li", (long)v.integer);
+  else
+    printf("nothing");
+}
+
+static void check(vm_t *vm, vm_program_t *program, u32 function,
+                  ika_value a, ika_value b, expected_t expected) {
+  ika_value args[] = {a, b};
+  vm_release_function(&functions[function]);
+  for (u32 call = 0; call < CALLS_PER_CHECK; call++) {
+    ika_value result = {0};
+    vm->fuel = CHECK_FUEL;
+    b8 ok = vm_execute(vm, program, function, args, &result);
+    checks++;
+    if (expected.error ? !ok && strcmp(vm->error, expected.error) == 0
+                       : ok && same_value(result, expected.value))
+      continue;
+    failures++;
+    printf("FAIL %s(", functions[function].name);
+    print_value(a);
+    printf(", ");
+    print_value(b);
+    printf(") on call %u: ", call + 1);
+    if (ok)
+      print_value(result);
+    else
+      printf("%s", vm->error);
+    printf(", expected ");
+    if (expected.error)
+      printf("%s\n", expected.error);
+    else {
+      print_value(expected.value);
+      printf("\n");
+    }
+    return;
+  }
+}
+
+static expected_t int_expected(u8 opcode, i64 a, i64 b) {
+  if ((opcode == DIV_I64 || opcode == MOD_I64) && b == 0)
+    return error("Integer division by zero");
+  if ((opcode == DIV_I64 || opcode == MOD_I64) && a == INT64_MIN && b == -1)
+    return error("Integer overflow in division");
+  switch (opcode) {
+  // Wrapping, like the vm
+  case ADD_I64:
+    return value(integer((i64)((u64)a + (u64)b)));
+  case SUB_I64:
+    return value(integer((i64)((u64)a - (u64)b)));
+  case MUL_I64:
+    return value(integer((i64)((u64)a * (u64)b)));
+  case DIV_I64:
+    return value(integer(a / b));
+  case MOD_I64:
+    return value(integer(a % b));
+  case EQ_I64:
+    return value(integer(a == b));
+  case NE_I64:
+    return value(integer(a != b));
+  case GT_I64:
+    return value(integer(a > b));
+  case GTE_I64:
+    return value(integer(a >= b));
+  case LT_I64:
+    return value(integer(a < b));
+  default:
+    return value(integer(a <= b));
+  }
+}
+
+static expected_t float_expected(u8 opcode, f64 a, f64 b) {
+  switch (opcode) {
+  case ADD_F64:
+    return value(phloat(a + b));
+  case SUB_F64:
+    return value(phloat(a - b));
+  case MUL_F64:
+    return value(phloat(a * b));
+  case DIV_F64:
+    return value(phloat(a / b));
+  case EQ_F64:
+    return value(integer(a == b));
+  case NE_F64:
+    return value(integer(a != b));
+  case GT_F64:
+    return value(integer(a > b));
+  case GTE_F64:
+    return value(integer(a >= b));
+  case LT_F64:
+    return value(integer(a < b));
+  default:
+    return value(integer(a <= b));
+  }
+}
+
+static void test_arithmetic(vm_t *vm, vm_program_t *program) {
+  i64 ints[] = {0, 1, -1, 2, 7, -7, 3, -3, 1000003, INT64_MAX, INT64_MIN};
+  u32 int_count = sizeof(ints) / sizeof(ints[0]);
+  for (u32 op = 0; op < INT_OPCODE_COUNT; op++) {
+    for (u32 i = 0; i < int_count; i++) {
+      for (u32 j = 0; j < int_count; j++) {
+        check(vm, program, op, integer(ints[i]), integer(ints[j]),
+              int_expected(int_opcodes[op], ints[i], ints[j]));
+      }
+    }
+  }
+  f64 floats[] = {0.0, -0.0, 1.5, -2.25, 1e300, 1e-300, INFINITY,
+                  -INFINITY, NAN};
+  u32 float_count = sizeof(floats) / sizeof(floats[0]);
+  for (u32 op = 0; op < FLOAT_OPCODE_COUNT; op++) {
+    for (u32 i = 0; i < float_count; i++) {
+      for (u32 j = 0; j < float_count; j++) {
+        check(vm, program, INT_OPCODE_COUNT + op, phloat(floats[i]),
+              phloat(floats[j]),
+              float_expected(float_opcodes[op], floats[i], floats[j]));
+      }
+    }
+  }
+}
+
+static void test_control_flow(vm_t *vm, vm_program_t *program) {
+  for (i64 n = -2; n <= 40; n++) {
+    i64 sum = 0;
+    for (i64 i = 0; i < n; i++)
+      sum += i * i % 7;
+    check(vm, program, SUM_SQUARES, integer(n), integer(0),
+          value(integer(sum)));
+    check(vm, program, COUNT_UP, integer(n), integer(0),
+          value(integer(n > 0 ? n : 0)));
+    check(vm, program, COUNTDOWN, integer(n), integer(0),
+          value(integer(n > 0 ? 3 * n : 0)));
+    f64 halves = 0.0;
+    for (i64 i = 0; i < n; i++)
+      halves += (f64)i * 0.5;
+    check(vm, program, HALVES, integer(n), integer(0),
+          value(phloat(halves)));
+  }
+  i64 depth = TAIL_CALL_DEPTH;
+  check(vm, program, SUM_TO, integer(depth), integer(0),
+        value(integer(depth * (depth + 1) / 2)));
+  check(vm, program, COUNTDOWN, integer(VM_MAX_FRAMES * 2), integer(0),
+        error("VM stack overflow"));
+  check(vm, program, FOREVER, integer(0), integer(0),
+        error("VM stack overflow"));
+  check(vm, program, NOTHING, integer(0), integer(0),
+        value((ika_value){.type = IKA_NONE}));
+}
+
+// Fuel is spent on calls and taken jumps, however they're dispatched
+static void test_fuel(vm_t *vm, vm_program_t *program) {
+  ika_value args[] = {integer(10), integer(0)};
+  for (u64 fuel = 0; fuel < 40; fuel++) {
+    vm_release_function(&functions[SUM_SQUARES]);
+    for (u32 call = 0; call < CALLS_PER_CHECK; call++) {
+      vm->fuel = fuel;
+      b8 ok = vm_execute(vm, program, SUM_SQUARES, args, NULL);
+      // The call and ten jumps back to the top of the loop
+      b8 expected = fuel >= 11;
+      checks++;
+      if (ok != expected || (ok && vm->fuel != fuel - 11)) {
+        failures++;
+        printf("FAIL sum_squares(10) with %lu fuel: %s, %lu left\n",
+               (unsigned long)fuel, ok ? "ran" : vm->error,
+               (unsigned long)vm->fuel);
+        break;
+      }
+    }
+  }
+}
+
+// Fusing has to have happened where it can, and only there
+static void test_fusing(u32 *sizes) {
+  u32 fusing[] = {SUM_SQUARES, COUNTDOWN, HALVES};
+  for (u32 i = 0; i < sizeof(fusing) / sizeof(fusing[0]); i++) {
+    vm_function_t *fn = &functions[fusing[i]];
+    checks++;
+#ifdef VM_SUPERINSTRUCTIONS
+    b8 ok = fn->code_size < sizes[fusing[i]];
+#else
+    b8 ok = fn->code_size == sizes[fusing[i]];
+#endif
+    if (!ok) {
+      failures++;
+      printf("FAIL %s is %u bytes after loading, %u before\n", fn->name,
+             fn->code_size, sizes[fusing[i]]);
+    }
+  }
+  checks++;
+  if (functions[COUNT_UP].code_size != sizes[COUNT_UP]) {
+    failures++;
+    printf("FAIL count_up was fused across a jump target\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  if (!initialize_allocator()) {
+    printf("Couldn't initialize allocator\n");
+    return 1;
+  }
+  for (u32 op = 0; op < INT_OPCODE_COUNT; op++)
+    functions[op] = build_binary(int_opcodes[op], int_parameters, IKA_INT);
+  for (u32 op = 0; op < FLOAT_OPCODE_COUNT; op++) {
+    b8 comparison = float_opcodes[op] >= EQ_F64;
+    functions[INT_OPCODE_COUNT + op] =
+        build_binary(float_opcodes[op], float_parameters,
+                     comparison ? IKA_INT : IKA_FLOAT);
+  }
+  functions[SUM_SQUARES] = build_sum_squares();
+  functions[COUNT_UP] = build_count_up();
+  functions[COUNTDOWN] = build_countdown(COUNTDOWN);
+  functions[SUM_TO] = build_sum_to(SUM_TO);
+  functions[HALVES] = build_halves();
+  functions[FOREVER] = build_forever(FOREVER);
+  functions[NOTHING] = build_nothing();
+  u32 sizes[FUNCTION_COUNT];
+  for (u32 i = 0; i < FUNCTION_COUNT; i++)
+    sizes[i] = functions[i].code_size;
+
+  vm_program_t program = {.functions = functions,
+                          .function_count = FUNCTION_COUNT};
+  vm_t vm;
+  vm_init(&vm);
+  if (!vm_load(&vm, &program)) {
+    printf("%s\n", vm.error);
+    return 1;
+  }
+  test_fusing(sizes);
+  test_arithmetic(&vm, &program);
+  test_control_flow(&vm, &program);
+  test_fuel(&vm, &program);
+  // Loading again mustn't change code that's already been loaded
+  u32 loaded_sizes[FUNCTION_COUNT];
+  for (u32 i = 0; i < FUNCTION_COUNT; i++)
+    loaded_sizes[i] = functions[i].code_size;
+  if (!vm_load(&vm, &program)) {
+    printf("%s\n", vm.error);
+    return 1;
+  }
+  for (u32 i = 0; i < FUNCTION_COUNT; i++) {
+    checks++;
+    if (functions[i].code_size != loaded_sizes[i]) {
+      failures++;
+      printf("FAIL loading %s again changed it\n", functions[i].name);
+    }
+  }
+  test_control_flow(&vm, &program);
+  printf("%lu checks, %lu failed\n", (unsigned long)checks,
+         (unsigned long)failures);
+  shutdown_allocator();
+  return failures ? 1 : 0;
+}
@@ -6,6 +6,7 @@
 #include "ast.h"
 #include "compiler.h"
 #include "errors.h"
+#include "resolver.h"
 #include "symbol_table.h"
 #include "tokens.h"
 #include "typechecker.h"
@@ -22,7 +23,10 @@ static void tc_error(tc_context_t ctx, u32 line, u32 column, const char *fmt,
 }
 
 static e_token_type determine_type_for_expression(tc_context_t ctx,
-                                                  ast_node_t *expression) {
+                                                  ast_node_t *expression);
+
+static e_token_type resolve_type_for_expression(tc_context_t ctx,
+                                                ast_node_t *expression) {
   switch (expression->type) {
   case ast_int_literal:
     return TOKEN_INT;
@@ -33,9 +37,7 @@ static e_token_type determine_type_for_expression(tc_context_t ctx,
   case ast_str_literal:
     return TOKEN_STR;
   case ast_symbol: {
-    assert(ctx.parent->type == ast_block);
-    symbol_table_entry_t *entry = symbol_table_lookup(
-        ctx.parent->block.symbol_table, expression->symbol.value);
+    symbol_table_entry_t *entry = expression->symbol.entry;
     if (entry) {
       return entry->type;
     } else {
@@ -78,9 +80,7 @@ static e_token_type determine_type_for_expression(tc_context_t ctx,
     }
   }
   case ast_fn_call: {
-    symbol_table_entry_t *entry =
-        symbol_table_lookup(ctx.parent->block.symbol_table,
-                            expression->fn_call.symbol->symbol.value);
+    symbol_table_entry_t *entry = expression->fn_call.symbol->symbol.entry;
     if (entry) {
       ast_node_t *function = (ast_node_t *)entry->node_address;
       return function->fn.return_type;
@@ -94,6 +94,16 @@ static e_token_type determine_type_for_expression(tc_context_t ctx,
   }
 }
 
+// Resolves an expression's type the first time it's asked for and caches it
+// on the node, so each sub-expression is only ever resolved (and any error
+// in it reported) once.
+static e_token_type determine_type_for_expression(tc_context_t ctx,
+                                                  ast_node_t *expression) {
+  if (expression->resolved_type == AST_TYPE_UNRESOLVED)
+    expression->resolved_type = resolve_type_for_expression(ctx, expression);
+  return expression->resolved_type;
+}
+
 static void check_decl(tc_context_t ctx, ast_node_t *node) {
   if (node->decl.expr) {
     e_token_type type = determine_type_for_expression(ctx, node->decl.expr);
@@ -104,13 +114,19 @@ static void check_decl(tc_context_t ctx, ast_node_t *node) {
                "Type mismatch.\n\nCannot assign type %s to type %s, these "
                "types are not convertable.",
                token_as_char[type], token_as_char[node->decl.type]);
+      return;
+    }
+    // Constants and globals are initialized with whatever calls can be run
+    // now already run
+    if (type != TOKEN_UNKNOWN &&
+        (node->decl.constant || !ctx.current_function)) {
+      comptime_fold_calls(ctx.comptime, node->decl.expr);
     }
   }
 }
 
 static void check_assignment(tc_context_t ctx, ast_node_t *node) {
-  symbol_table_entry_t *entry = symbol_table_lookup(
-      ctx.parent->block.symbol_table, node->assignment.symbol->symbol.value);
+  symbol_table_entry_t *entry = node->assignment.symbol->symbol.entry;
   if (entry && !entry->constant) {
     e_token_type expr_type =
         determine_type_for_expression(ctx, node->assignment.expr);
@@ -138,9 +154,8 @@ static void check_print_stmt(tc_context_t ctx, ast_node_t *node) {
   }
 }
 
-static void update_symbol_table(symbol_table_t *symbol_table, char *symbol,
-                                e_token_type type) {
-  symbol_table_entry_t *entry = symbol_table_lookup(symbol_table, symbol);
+static void update_symbol_table(ast_node_t *symbol, e_token_type type) {
+  symbol_table_entry_t *entry = symbol->symbol.entry;
   if (entry) {
     entry->type = type;
   }
@@ -167,9 +182,8 @@ static b8 tc_resolve_function_return(tc_context_t ctx, ast_node_t *node,
     }
     return TRUE;
   } else {
-    ast_node_t *children = node->block.nodes;
-    for (u32 i = 0; i < darray_len(children); i++) {
-      ast_node_t child = children[i];
+    for (u32 i = 0; i < small_vec_len(node->block.nodes); i++) {
+      ast_node_t child = *small_vec_get(node->block.nodes, i);
       // Look for all the branching node types, and follow those paths checking
       // if returns statement are part of the branch.
       if (child.type == ast_if_stmt) {
@@ -187,15 +201,12 @@ static b8 tc_resolve_function_return(tc_context_t ctx, ast_node_t *node,
 }
 
 static void check_fn_call(tc_context_t ctx, fn_call_t *fn_call) {
-  symbol_table_entry_t *entry = symbol_table_lookup(
-      ctx.parent->block.symbol_table, fn_call->symbol->symbol.value);
+  symbol_table_entry_t *entry = fn_call->symbol->symbol.entry;
   if (entry) {
     ast_node_t *function = (ast_node_t *)entry->node_address;
-    da_nodes *params = function->fn.parameters;
-    da_nodes *exprs = fn_call->exprs;
-    for (uint32_t i = 0; i < darray_len(params); i++) {
-      ast_node_t *param = &params[i];
-      ast_node_t *expr = &exprs[i];
+    for (uint32_t i = 0; i < small_vec_len(function->fn.parameters); i++) {
+      ast_node_t *param = small_vec_get(function->fn.parameters, i);
+      ast_node_t *expr = small_vec_get(fn_call->exprs, i);
       e_token_type expr_type = determine_type_for_expression(ctx, expr);
       if (param->decl.type != expr_type) {
         char *param_name = param->decl.symbol->symbol.value;
@@ -211,16 +222,13 @@ static void check_fn_call(tc_context_t ctx, fn_call_t *fn_call) {
 
 static void tc_check_types(tc_context_t ctx, ast_node_t *root) {
   assert(root->type == ast_block);
-  symbol_table_t *current_symbol_table = root->block.symbol_table;
   ctx.parent = root;
-  da_nodes *children = root->block.nodes;
-  for (u64 i = 0; i < darray_len(children); i++) {
-    ast_node_t *child = &children[i];
+  for (u64 i = 0; i < small_vec_len(root->block.nodes); i++) {
+    ast_node_t *child = small_vec_get(root->block.nodes, i);
     switch (child->type) {
     case ast_decl:
       check_decl(ctx, child);
-      update_symbol_table(current_symbol_table,
-                          child->decl.symbol->symbol.value, child->decl.type);
+      update_symbol_table(child->decl.symbol, child->decl.type);
       break;
     case ast_assignment:
       check_assignment(ctx, child);
@@ -278,8 +286,14 @@ static void tc_check_types(tc_context_t ctx, ast_node_t *root) {
 void tc_check(compilation_unit_t *unit) {
   // Assumes the root node is a block
   assert(unit->root->type == ast_block);
-  tc_context_t ctx = {
-      .errors = unit->errors, .parent = NULL, .current_function = NULL};
+  comptime_t comptime;
+  comptime_init(&comptime);
+  tc_context_t ctx = {.errors = unit->errors,
+                      .parent = NULL,
+                      .current_function = NULL,
+                      .comptime = &comptime};
 
+  resolver_bind(unit->root);
   tc_check_types(ctx, unit->root);
+  comptime_deinit(&comptime);
 }
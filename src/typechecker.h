@@ -2,6 +2,7 @@
 
 #include "compiler.h"
 
+#include "comptime.h"
 #include "errors.h"
 #include "symbol_table.h"
 
@@ -9,6 +10,8 @@ typedef struct {
   syntax_error_t *errors;
   ast_node_t *parent;
   ast_node_t *current_function;
+  // Evaluates calls in constant contexts
+  comptime_t *comptime;
 } tc_context_t;
 
 void tc_check(compilation_unit_t *unit);
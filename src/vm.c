@@ -1,142 +1,755 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "../lib/allocator.h"
 #include "../lib/assert.h"
 
-#include "rt/darray.h"
-
+#include "bytecode.h"
+#include "jit.h"
 #include "vm.h"
 
-static ika_value op(int op) { return (ika_value){.type = IKA_OP, .value = op}; }
-
-static ika_value integer(int value) {
-  return (ika_value){.type = IKA_INT, .value = value};
+static ika_value integer(i64 value) {
+  return (ika_value){.type = IKA_INT, .integer = value};
 }
 
-static ika_value phloat(float value) {
-  return (ika_value){.type = IKA_FLOAT, .value = value};
+static ika_value phloat(f64 value) {
+  return (ika_value){.type = IKA_FLOAT, .floating = value};
 }
 
-static ika_value string(char *value) {
-  return (ika_value){.type = IKA_STR, .value = (i64)value};
+// Division is the one integer operation that can fail at runtime
+static const char *ika_division_error(i64 a, i64 b) {
+  if (b == 0)
+    return "Integer division by zero";
+  if (a == INT64_MIN && b == -1)
+    return "Integer overflow in division";
+  return NULL;
 }
 
-static void ika_add(ika_value *stack) {
-  ika_value r1, r2;
-  darray_pop(stack, &r1);
-  darray_pop(stack, &r2);
-  ASSERT_MSG((r1.type == r2.type), "Type mismatch in vm opcode.  Compiler bug");
-  switch (r1.type) {
-  case IKA_INT: {
-    ika_value res = {.type = IKA_INT, .value = (i64)r1.value + (i64)r2.value};
-    darray_push(stack, res);
+void vm_print(const ika_value *v) {
+  switch (v->type) {
+  case IKA_INT:
+    printf("%li\n", v->integer);
     break;
-  }
-  case IKA_FLOAT: {
-    ika_value res = {.type = IKA_FLOAT, .value = (f64)r1.value + (f64)r2.value};
-    darray_push(stack, res);
+  case IKA_FLOAT:
+    printf("%f\n", v->floating);
     break;
-  }
   case IKA_STR:
-    ASSERT_MSG((FALSE), "Cannot add strings");
+    printf("%s\n", v->string);
     break;
-  case IKA_OP:
-    ASSERT(FALSE);
+  case IKA_NONE:
+    ASSERT_MSG((FALSE), "Tried to print a register without a value");
     break;
   }
 }
 
-static void ika_mul(ika_value *stack) {
-  ika_value r1, r2;
-  darray_pop(stack, &r1);
-  darray_pop(stack, &r2);
-  ASSERT_MSG((r1.type == r2.type), "Type mismatch in vm opcode.  Compiler bug");
-  switch (r1.type) {
-  case IKA_INT: {
-    ika_value res = {.type = IKA_INT, .value = (i64)r1.value * (i64)r2.value};
-    darray_push(stack, res);
-    break;
+#ifdef VM_PROFILE
+// Functions past the first VM_PROFILE_MAX_FUNCTIONS - 1 names are lumped
+// together.  Only the most common pairs are printed.
+#define VM_PROFILE_MAX_FUNCTIONS 256
+#define VM_PROFILE_TOP_PAIRS 20
+
+typedef struct vm_profile_function_t {
+  char *name;
+  u64 calls;
+  u64 cycles;
+} vm_profile_function_t;
+
+typedef struct vm_profile_pair_t {
+  u64 count;
+  u8 first;
+  u8 second;
+} vm_profile_pair_t;
+
+static const char *opcode_names[OPCODE_COUNT] = {
+    [ADD_I64] = "ADD_I64",
+    [SUB_I64] = "SUB_I64",
+    [MUL_I64] = "MUL_I64",
+    [DIV_I64] = "DIV_I64",
+    [MOD_I64] = "MOD_I64",
+    [ADD_F64] = "ADD_F64",
+    [SUB_F64] = "SUB_F64",
+    [MUL_F64] = "MUL_F64",
+    [DIV_F64] = "DIV_F64",
+    [EQ_I64] = "EQ_I64",
+    [NE_I64] = "NE_I64",
+    [GT_I64] = "GT_I64",
+    [GTE_I64] = "GTE_I64",
+    [LT_I64] = "LT_I64",
+    [LTE_I64] = "LTE_I64",
+    [EQ_F64] = "EQ_F64",
+    [NE_F64] = "NE_F64",
+    [GT_F64] = "GT_F64",
+    [GTE_F64] = "GTE_F64",
+    [LT_F64] = "LT_F64",
+    [LTE_F64] = "LTE_F64",
+    [I64_TO_F64] = "I64_TO_F64",
+    [MOV] = "MOV",
+    [LOAD] = "LOAD",
+    [JUMP] = "JUMP",
+    [JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [CALL] = "CALL",
+    [TAIL_CALL] = "TAIL_CALL",
+    [PRINT] = "PRINT",
+    [RETURN] = "RETURN",
+    [EOP] = "EOP",
+    [LT_I64_JUMP_IF_FALSE] = "LT_I64_JUMP_IF_FALSE",
+    [ADD_I64_JUMP] = "ADD_I64_JUMP",
+    [LOAD_ADD_I64] = "LOAD_ADD_I64",
+    [LOAD_SUB_I64] = "LOAD_SUB_I64",
+};
+
+// Kept outside any vm, and in memory of its own, so it's still around for
+// the report once everything else has been torn down.  The extra row of
+// pairs is for the first dispatch of an execution, which has no
+// predecessor.
+static u64 profile_opcodes[OPCODE_COUNT];
+static u64 profile_pairs[OPCODE_COUNT + 1][OPCODE_COUNT];
+static vm_profile_function_t profile_functions[VM_PROFILE_MAX_FUNCTIONS];
+static u32 profile_function_count = 0;
+
+// Time stamp counter ticks where there is one, otherwise nanoseconds
+static u64 vm_profile_clock(void) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static int compare_opcodes(const void *a, const void *b) {
+  u64 ca = profile_opcodes[*(const u8 *)a];
+  u64 cb = profile_opcodes[*(const u8 *)b];
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+  const vm_profile_pair_t *pa = a, *pb = b;
+  return pa->count < pb->count ? 1 : pa->count > pb->count ? -1 : 0;
+}
+
+static int compare_functions(const void *a, const void *b) {
+  const vm_profile_function_t *fa = a, *fb = b;
+  return fa->cycles < fb->cycles ? 1 : fa->cycles > fb->cycles ? -1 : 0;
+}
+
+static f64 percent(u64 part, u64 total) {
+  return total ? 100.0 * part / total : 0.0;
+}
+
+static void vm_profile_print(void) {
+  u64 dispatches = 0;
+  u8 opcodes[OPCODE_COUNT];
+  for (u32 i = 0; i < OPCODE_COUNT; i++) {
+    dispatches += profile_opcodes[i];
+    opcodes[i] = (u8)i;
   }
-  case IKA_FLOAT: {
-    ika_value res = {.type = IKA_FLOAT, .value = (f64)r1.value * (f64)r2.value};
-    darray_push(stack, res);
-    break;
+  qsort(opcodes, OPCODE_COUNT, sizeof(u8), compare_opcodes);
+  fprintf(stderr, "VM profile: %lu dispatches\n", dispatches);
+  for (u32 i = 0; i < OPCODE_COUNT && profile_opcodes[opcodes[i]]; i++) {
+    fprintf(stderr, "  %12lu %5.1f%%  %s\n", profile_opcodes[opcodes[i]],
+            percent(profile_opcodes[opcodes[i]], dispatches),
+            opcode_names[opcodes[i]]);
   }
-  case IKA_STR:
-    ASSERT_MSG((FALSE), "Cannot mul strings");
-    break;
-  case IKA_OP:
-    ASSERT(FALSE);
-    break;
+
+  static vm_profile_pair_t pairs[OPCODE_COUNT * OPCODE_COUNT];
+  u32 pair_count = 0;
+  u64 pair_total = 0;
+  for (u32 first = 0; first < OPCODE_COUNT; first++) {
+    for (u32 second = 0; second < OPCODE_COUNT; second++) {
+      u64 count = profile_pairs[first][second];
+      if (count == 0)
+        continue;
+      pair_total += count;
+      pairs[pair_count++] = (vm_profile_pair_t){
+          .count = count, .first = (u8)first, .second = (u8)second};
+    }
+  }
+  qsort(pairs, pair_count, sizeof(vm_profile_pair_t), compare_pairs);
+  fprintf(stderr, "Top opcode pairs:\n");
+  for (u32 i = 0; i < pair_count && i < VM_PROFILE_TOP_PAIRS; i++) {
+    fprintf(stderr, "  %12lu %5.1f%%  %s -> %s\n", pairs[i].count,
+            percent(pairs[i].count, pair_total), opcode_names[pairs[i].first],
+            opcode_names[pairs[i].second]);
+  }
+
+  u64 cycles = 0;
+  for (u32 i = 0; i < profile_function_count; i++)
+    cycles += profile_functions[i].cycles;
+  qsort(profile_functions, profile_function_count,
+        sizeof(vm_profile_function_t), compare_functions);
+  fprintf(stderr, "Functions by self time:\n");
+  for (u32 i = 0; i < profile_function_count; i++) {
+    vm_profile_function_t *f = &profile_functions[i];
+    fprintf(stderr, "  %14lu cycles %5.1f%% %10lu calls  %s\n", f->cycles,
+            percent(f->cycles, cycles), f->calls, f->name);
   }
 }
 
-static void ika_print(ika_value *stack) {
-  ika_value v;
-  darray_pop(stack, &v);
-  switch (v.type) {
-  case IKA_INT:
-    printf("%li\n", (i64)v.value);
-    break;
-  case IKA_FLOAT:
-    printf("%f\n", (double)v.value);
-    break;
-  case IKA_STR:
-    printf("%s\n", (char *)v.value);
-    break;
-  case IKA_OP:
-    ASSERT_MSG((FALSE), "Tried to print an OP");
-    break;
+// Functions are profiled by name, so the same function in different
+// programs (compile time evaluation builds a new one per call) adds up.
+static u32 vm_profile_slot(vm_function_t *fn) {
+  if (fn->profile_slot)
+    return fn->profile_slot - 1;
+  u32 slot = 0;
+  while (slot < profile_function_count &&
+         strcmp(profile_functions[slot].name, fn->name) != 0)
+    slot++;
+  if (slot == VM_PROFILE_MAX_FUNCTIONS) {
+    slot--;
+  } else if (slot == profile_function_count) {
+    const char *name =
+        slot == VM_PROFILE_MAX_FUNCTIONS - 1 ? "(others)" : fn->name;
+    u64 length = strlen(name) + 1;
+    profile_functions[slot].name = malloc(length);
+    memcpy(profile_functions[slot].name, name, length);
+    profile_function_count++;
   }
+  fn->profile_slot = slot + 1;
+  return slot;
 }
 
-void execute(ika_value *codez) {
-  ika_value *stack = darray_init(ika_value);
-  u64 i = 0;
-  u32 exit = FALSE;
-  do {
-    ika_value opcode = codez[i];
-    switch (opcode.type) {
-    case IKA_OP:
-      switch (opcode.value) {
-      case ADD: {
-        ika_add(stack);
-        break;
-      }
-      case MUL: {
-        ika_mul(stack);
-        break;
-      }
-      case PRINT:
-        ika_print(stack);
-        break;
-      case EOP:
-        exit = TRUE;
-        break;
-      default:
-        printf("opcode %li not implemented yet", opcode.value);
-        break;
-      }
-      break;
+static void vm_profile_opcode(u8 *previous, u8 opcode) {
+  profile_opcodes[opcode]++;
+  profile_pairs[*previous][opcode]++;
+  *previous = opcode;
+}
+
+// Charges the time since *mark to the function in *slot and moves on to
+// next, which a call is counted against if call is set.  A NULL next stops
+// the clock.
+static void vm_profile_switch(u32 *slot, u64 *mark, vm_function_t *next,
+                              b8 call) {
+  u64 now = vm_profile_clock();
+  if (*slot < VM_PROFILE_MAX_FUNCTIONS)
+    profile_functions[*slot].cycles += now - *mark;
+  if (next) {
+    *slot = vm_profile_slot(next);
+    if (call)
+      profile_functions[*slot].calls++;
+  }
+  // Leaves out the time spent above
+  *mark = vm_profile_clock();
+}
+
+#define VM_PROFILE_OPCODE(opcode) vm_profile_opcode(&previous, opcode);
+#define VM_PROFILE_SWITCH(next, call)                                          \
+  vm_profile_switch(&profiled, &mark, next, call);
+#else
+#define VM_PROFILE_OPCODE(opcode)
+#define VM_PROFILE_SWITCH(next, call)
+#endif
+
+void vm_init(vm_t *vm) {
+  vm->stack = imust_alloc(sizeof(ika_value) * VM_STACK_SIZE);
+  vm->frames = imust_alloc(sizeof(vm_frame_t) * VM_MAX_FRAMES);
+  vm->fuel = VM_UNLIMITED_FUEL;
+  vm->error = NULL;
+#ifdef VM_PROFILE
+  static b8 profiling = FALSE;
+  if (!profiling) {
+    profiling = TRUE;
+    atexit(vm_profile_print);
+  }
+#endif
+}
+
+void vm_release_function(vm_function_t *fn) {
+#ifdef VM_JIT
+  if (fn->native)
+    jit_free(fn->native);
+#endif
+  fn->native = NULL;
+  fn->invocations = 0;
+}
+
+b8 vm_load(vm_t *vm, vm_program_t *program) {
+  static char message[256];
+  u32 function, offset;
+  const char *error = bytecode_verify(program, &function, &offset);
+  if (error) {
+    snprintf(message, sizeof(message), "Invalid bytecode in %s at %u: %s",
+             program->functions[function].name, offset, error);
+    vm->error = message;
+    return FALSE;
+  }
+#ifdef VM_SUPERINSTRUCTIONS
+  for (u32 i = 0; i < program->function_count; i++)
+    bytecode_fuse(&program->functions[i]);
+#endif
+  program->verified = TRUE;
+  return TRUE;
+}
+
+// Dispatch with computed gotos where the compiler supports them.  Each
+// handler jumps straight to the next one, which gives every opcode its own
+// indirect branch for the predictor to learn.  Build with
+// -DVM_SWITCH_DISPATCH to use the portable switch instead.
+// Labels as values are a GNU extension, -pedantic is told so around vm_run.
+#if !defined(VM_SWITCH_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define VM_THREADED_DISPATCH
+#endif
+
+#ifdef VM_JIT
+// Counts a call to fn, compiling it once it's hot.  Returns the native code
+// to run instead of its bytecode, if there is any.
+static vm_native_t vm_native(vm_program_t *program, vm_function_t *fn) {
+  if (!fn->native && ++fn->invocations == VM_JIT_THRESHOLD)
+    fn->native = jit_compile(program, (u32)(fn - program->functions));
+  return fn->native;
+}
+#endif
+
+#ifdef VM_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Interprets fn, whose arguments are already in registers, with frame as its
+// slot on the frame stack.  Calls it makes are pushed above frame, and it
+// returns once fn itself does.
+static b8 vm_run(vm_t *vm, vm_program_t *program, vm_frame_t *frame,
+                 vm_function_t *fn, ika_value *registers, ika_value *result) {
+  // The current frame is kept in locals, it's only written back to the
+  // frame stack on a call.
+  vm_frame_t *base = frame;
+  const u8 *ip = fn->code;
+  ika_value *constants = fn->constants;
+  u64 fuel = vm->fuel;
+#ifdef VM_PROFILE
+  u8 previous = OPCODE_COUNT;
+  u32 profiled = UINT32_MAX;
+  u64 mark = 0;
+  VM_PROFILE_SWITCH(fn, TRUE);
+#endif
+
+#define OPERAND() bytecode_read_operand(&ip)
+#define TARGET() bytecode_read_target(&ip)
+
+  // Fuel is counted in a local, so execution has to leave through VM_EXIT
+  // to save what's left.  Anything that runs for long either loops or
+  // recurses, so only calls and taken jumps burn it.
+#define VM_EXIT(success)                                                       \
+  {                                                                            \
+    VM_PROFILE_SWITCH(NULL, FALSE);                                            \
+    vm->fuel = fuel;                                                           \
+    return success;                                                            \
+  }
+#define VM_BURN_FUEL()                                                         \
+  if (fuel-- == 0) {                                                           \
+    vm->error = "Out of fuel";                                                 \
+    VM_EXIT(FALSE);                                                            \
+  }
+  // Hands value to the caller, or to whoever entered vm_run once the
+  // function it was entered with returns
+#define VM_RETURN(value)                                                       \
+  {                                                                            \
+    if (frame == base) {                                                       \
+      *result = value;                                                         \
+      VM_EXIT(TRUE);                                                           \
+    }                                                                          \
+    frame--;                                                                   \
+    fn = frame->function;                                                      \
+    VM_PROFILE_SWITCH(fn, FALSE);                                              \
+    ip = frame->ip;                                                            \
+    constants = fn->constants;                                                 \
+    registers = frame->registers;                                              \
+    registers[frame->return_register] = value;                                 \
+    VM_DISPATCH();                                                             \
+  }
+
+#ifdef VM_THREADED_DISPATCH
+  static void *dispatch_table[OPCODE_COUNT] = {
+      [ADD_I64] = &&op_ADD_I64,
+      [SUB_I64] = &&op_SUB_I64,
+      [MUL_I64] = &&op_MUL_I64,
+      [DIV_I64] = &&op_DIV_I64,
+      [MOD_I64] = &&op_MOD_I64,
+      [ADD_F64] = &&op_ADD_F64,
+      [SUB_F64] = &&op_SUB_F64,
+      [MUL_F64] = &&op_MUL_F64,
+      [DIV_F64] = &&op_DIV_F64,
+      [EQ_I64] = &&op_EQ_I64,
+      [NE_I64] = &&op_NE_I64,
+      [GT_I64] = &&op_GT_I64,
+      [GTE_I64] = &&op_GTE_I64,
+      [LT_I64] = &&op_LT_I64,
+      [LTE_I64] = &&op_LTE_I64,
+      [EQ_F64] = &&op_EQ_F64,
+      [NE_F64] = &&op_NE_F64,
+      [GT_F64] = &&op_GT_F64,
+      [GTE_F64] = &&op_GTE_F64,
+      [LT_F64] = &&op_LT_F64,
+      [LTE_F64] = &&op_LTE_F64,
+      [I64_TO_F64] = &&op_I64_TO_F64,
+      [MOV] = &&op_MOV,
+      [LOAD] = &&op_LOAD,
+      [JUMP] = &&op_JUMP,
+      [JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+      [CALL] = &&op_CALL,
+      [TAIL_CALL] = &&op_TAIL_CALL,
+      [PRINT] = &&op_PRINT,
+      [RETURN] = &&op_RETURN,
+      [EOP] = &&op_EOP,
+      [LT_I64_JUMP_IF_FALSE] = &&op_LT_I64_JUMP_IF_FALSE,
+      [ADD_I64_JUMP] = &&op_ADD_I64_JUMP,
+      [LOAD_ADD_I64] = &&op_LOAD_ADD_I64,
+      [LOAD_SUB_I64] = &&op_LOAD_SUB_I64,
+  };
+#define VM_CASE(name)                                                          \
+  op_##name:                                                                   \
+  VM_PROFILE_OPCODE(name)
+#define VM_DISPATCH() goto *dispatch_table[*ip++]
+  VM_DISPATCH();
+#else
+#define VM_CASE(name)                                                          \
+  case name:                                                                   \
+    VM_PROFILE_OPCODE(name)
+#define VM_DISPATCH() continue
+  for (;;) {
+    switch (*ip++) {
+#endif
+
+  VM_CASE(ADD_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer((i64)(registers[a].value + registers[b].value));
+    VM_DISPATCH();
+  }
+  VM_CASE(SUB_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer((i64)(registers[a].value - registers[b].value));
+    VM_DISPATCH();
+  }
+  VM_CASE(MUL_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer((i64)(registers[a].value * registers[b].value));
+    VM_DISPATCH();
+  }
+  VM_CASE(DIV_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    const char *error =
+        ika_division_error(registers[a].integer, registers[b].integer);
+    if (error) {
+      vm->error = error;
+      VM_EXIT(FALSE);
+    }
+    registers[dst] = integer(registers[a].integer / registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(MOD_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    const char *error =
+        ika_division_error(registers[a].integer, registers[b].integer);
+    if (error) {
+      vm->error = error;
+      VM_EXIT(FALSE);
+    }
+    registers[dst] = integer(registers[a].integer % registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(ADD_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = phloat(registers[a].floating + registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(SUB_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = phloat(registers[a].floating - registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(MUL_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = phloat(registers[a].floating * registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(DIV_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = phloat(registers[a].floating / registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(EQ_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].integer == registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(NE_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].integer != registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(GT_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].integer > registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(GTE_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].integer >= registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(LT_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].integer < registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(LTE_I64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].integer <= registers[b].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(EQ_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].floating == registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(NE_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].floating != registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(GT_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].floating > registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(GTE_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].floating >= registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(LT_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].floating < registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(LTE_F64) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND();
+    registers[dst] = integer(registers[a].floating <= registers[b].floating);
+    VM_DISPATCH();
+  }
+  VM_CASE(I64_TO_F64) {
+    u32 dst = OPERAND(), src = OPERAND();
+    registers[dst] = phloat((f64)registers[src].integer);
+    VM_DISPATCH();
+  }
+  VM_CASE(MOV) {
+    u32 dst = OPERAND(), src = OPERAND();
+    registers[dst] = registers[src];
+    VM_DISPATCH();
+  }
+  VM_CASE(LOAD) {
+    u32 dst = OPERAND(), k = OPERAND();
+    registers[dst] = constants[k];
+    VM_DISPATCH();
+  }
+  VM_CASE(JUMP) {
+    VM_BURN_FUEL();
+    ip = fn->code + TARGET();
+    VM_DISPATCH();
+  }
+  VM_CASE(JUMP_IF_FALSE) {
+    u32 cond = OPERAND(), target = TARGET();
+    if (registers[cond].value == 0) {
+      VM_BURN_FUEL();
+      ip = fn->code + target;
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(CALL) {
+    u32 dst = OPERAND(), function = OPERAND();
+    u32 first_arg = OPERAND(), arg_count = OPERAND();
+    VM_BURN_FUEL();
+    vm_function_t *callee = &program->functions[function];
+    // The callee's frame starts right after the caller's
+    ika_value *callee_registers = registers + fn->register_count;
+    if (frame + 1 == vm->frames + VM_MAX_FRAMES ||
+        callee_registers + callee->register_count >
+            vm->stack + VM_STACK_SIZE) {
+      vm->error = "VM stack overflow";
+      VM_EXIT(FALSE);
+    }
+    for (u32 i = 0; i < arg_count; i++)
+      callee_registers[i] = registers[first_arg + i];
+#ifdef VM_JIT
+    vm_native_t native = vm_native(program, callee);
+    if (native) {
+      vm->fuel = fuel;
+      b8 success =
+          native(vm, program, frame + 1, callee_registers, &registers[dst]);
+      fuel = vm->fuel;
+      if (!success)
+        VM_EXIT(FALSE);
+      VM_DISPATCH();
+    }
+#endif
+    *frame = (vm_frame_t){.function = fn,
+                          .ip = ip,
+                          .registers = registers,
+                          .return_register = dst};
+    frame++;
+    VM_PROFILE_SWITCH(callee, TRUE);
+    fn = callee;
+    ip = fn->code;
+    constants = fn->constants;
+    registers = callee_registers;
+    VM_DISPATCH();
+  }
+  VM_CASE(TAIL_CALL) {
+    u32 function = OPERAND(), first_arg = OPERAND(), arg_count = OPERAND();
+    VM_BURN_FUEL();
+    vm_function_t *callee = &program->functions[function];
+    // The callee takes over the caller's frame
+    if (registers + callee->register_count > vm->stack + VM_STACK_SIZE) {
+      vm->error = "VM stack overflow";
+      VM_EXIT(FALSE);
+    }
+    // Arguments only ever move down, so copying from the first is safe
+    for (u32 i = 0; i < arg_count; i++)
+      registers[i] = registers[first_arg + i];
+#ifdef VM_JIT
+    vm_native_t native = vm_native(program, callee);
+    if (native) {
+      ika_value value;
+      vm->fuel = fuel;
+      b8 success = native(vm, program, frame, registers, &value);
+      fuel = vm->fuel;
+      if (!success)
+        VM_EXIT(FALSE);
+      VM_RETURN(value);
+    }
+#endif
+    VM_PROFILE_SWITCH(callee, TRUE);
+    fn = callee;
+    ip = fn->code;
+    constants = fn->constants;
+    VM_DISPATCH();
+  }
+  VM_CASE(PRINT) {
+    vm_print(&registers[OPERAND()]);
+    VM_DISPATCH();
+  }
+  VM_CASE(RETURN) {
+    ika_value value = registers[OPERAND()];
+    VM_RETURN(value);
+  }
+  VM_CASE(EOP) {
+    ika_value value = {.type = IKA_NONE};
+    VM_RETURN(value);
+  }
+
+  VM_CASE(LT_I64_JUMP_IF_FALSE) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND(), target = TARGET();
+    b8 less = registers[a].integer < registers[b].integer;
+    registers[dst] = integer(less);
+    if (!less) {
+      VM_BURN_FUEL();
+      ip = fn->code + target;
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(ADD_I64_JUMP) {
+    u32 dst = OPERAND(), a = OPERAND(), b = OPERAND(), target = TARGET();
+    registers[dst] = integer((i64)(registers[a].value + registers[b].value));
+    VM_BURN_FUEL();
+    ip = fn->code + target;
+    VM_DISPATCH();
+  }
+  VM_CASE(LOAD_ADD_I64) {
+    u32 tmp = OPERAND(), k = OPERAND(), dst = OPERAND(), a = OPERAND();
+    registers[tmp] = constants[k];
+    registers[dst] =
+        integer((i64)(registers[a].value + registers[tmp].value));
+    VM_DISPATCH();
+  }
+  VM_CASE(LOAD_SUB_I64) {
+    u32 tmp = OPERAND(), k = OPERAND(), dst = OPERAND(), a = OPERAND();
+    registers[tmp] = constants[k];
+    registers[dst] =
+        integer((i64)(registers[a].value - registers[tmp].value));
+    VM_DISPATCH();
+  }
+
+#ifndef VM_THREADED_DISPATCH
     default:
-      darray_append(stack, opcode);
+      printf("opcode %d not implemented yet", ip[-1]);
+      vm->error = "Unknown opcode";
+      VM_EXIT(FALSE);
     }
-    i++;
-  } while (exit != TRUE);
+  }
+#endif
+
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_BURN_FUEL
+#undef VM_RETURN
+#undef VM_EXIT
+#undef OPERAND
+#undef TARGET
 }
 
-/* int main(int argc, char **argv) { */
-/*   initialize_allocator(); */
-/*   printf("vm startup\n\n"); */
+#ifdef VM_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
 
-/*   char *message = "Result is:"; */
+// Runs fn as the function in frame, natively if it's been compiled
+static b8 vm_enter(vm_t *vm, vm_program_t *program, vm_frame_t *frame,
+                   vm_function_t *fn, ika_value *registers,
+                   ika_value *result) {
+#ifdef VM_JIT
+  vm_native_t native = vm_native(program, fn);
+  if (native)
+    return native(vm, program, frame, registers, result);
+#endif
+  return vm_run(vm, program, frame, fn, registers, result);
+}
 
-/*   ika_value codez[] = {integer(10), integer(20), op(ADD), */
-/*                        integer(45), op(MUL),     string(message), */
-/*                        op(PRINT),   op(PRINT),   op(EOP)}; */
-/*   execute(codez); */
+b8 vm_call(vm_t *vm, vm_program_t *program, vm_frame_t *frame, u32 function,
+           u32 first_arg, ika_value *result) {
+  vm_function_t *callee = &program->functions[function];
+  // The callee's frame starts right after the caller's
+  ika_value *registers = frame->registers + frame->function->register_count;
+  if (frame + 1 == vm->frames + VM_MAX_FRAMES ||
+      registers + callee->register_count > vm->stack + VM_STACK_SIZE) {
+    vm->error = "VM stack overflow";
+    return FALSE;
+  }
+  for (u32 i = 0; i < callee->parameter_count; i++)
+    registers[i] = frame->registers[first_arg + i];
+  return vm_enter(vm, program, frame + 1, callee, registers, result);
+}
 
-/*   printf("\nvm shutdown\n\n"); */
+b8 vm_tail_call(vm_t *vm, vm_program_t *program, vm_frame_t *frame,
+                u32 function, u32 first_arg, ika_value *result) {
+  vm_function_t *callee = &program->functions[function];
+  ika_value *registers = frame->registers;
+  if (registers + callee->register_count > vm->stack + VM_STACK_SIZE) {
+    vm->error = "VM stack overflow";
+    return FALSE;
+  }
+  for (u32 i = 0; i < callee->parameter_count; i++)
+    registers[i] = registers[first_arg + i];
+  return vm_enter(vm, program, frame, callee, registers, result);
+}
 
-/*   shutdown_allocator(); */
-/* } */
+b8 vm_execute(vm_t *vm, vm_program_t *program, u32 function, ika_value *args,
+              ika_value *result) {
+  ASSERT_MSG((program->verified), "vm programs must go through vm_load");
+  ASSERT_MSG((function < program->function_count), "Unknown vm function");
+  vm_function_t *fn = &program->functions[function];
+  if (fn->register_count > VM_STACK_SIZE) {
+    vm->error = "VM stack overflow";
+    return FALSE;
+  }
+  vm->error = NULL;
+  for (u32 i = 0; i < fn->parameter_count; i++)
+    vm->stack[i] = args[i];
+  ika_value value;
+  if (!vm_enter(vm, program, vm->frames, fn, vm->stack, &value))
+    return FALSE;
+  if (result)
+    *result = value;
+  return TRUE;
+}
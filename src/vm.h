@@ -2,31 +2,117 @@
 
 #include "defines.h"
 
+// Fuse common instruction pairs into superinstructions when a program is
+// loaded.  Build with -DVM_NO_SUPERINSTRUCTIONS to run the bytecode as the
+// compiler emitted it.
+#ifndef VM_NO_SUPERINSTRUCTIONS
+#define VM_SUPERINSTRUCTIONS
+#endif
+
+// Build with -DVM_PROFILE to count how often each opcode and each pair of
+// consecutive opcodes is dispatched, and how much time is spent in each
+// function.  The counts are printed to stderr when the process exits.
+// Profiling only sees the interpreter, so it turns the JIT off.
+
+// Compile a function to native code once it has been invoked
+// VM_JIT_THRESHOLD times, after which calls to it run the native code.  Only
+// x86-64 Linux is supported, build with -DVM_NO_JIT to always interpret.
+#if defined(__x86_64__) && defined(__linux__) && !defined(VM_NO_JIT) &&     \
+    !defined(VM_PROFILE)
+#define VM_JIT
+#endif
+#ifndef VM_JIT_THRESHOLD
+#define VM_JIT_THRESHOLD 100
+#endif
+
+// Registers available to all frames together, and the deepest call chain the
+// VM will run.  Both are allocated once up front.
+#define VM_STACK_SIZE (64 * 1024)
+#define VM_MAX_FRAMES 1024
+
+// Fuel a new vm starts with, more than anything can burn
+#define VM_UNLIMITED_FUEL UINT64_MAX
+
+// Instructions name the registers they read and write, registers are
+// numbered slots in the current function's frame.  See bytecode.h for how
+// they're encoded.
+//
+// Arithmetic and comparisons come in one form per operand type, chosen by
+// the compiler from the types the typechecker resolved.  vm_load verifies
+// every register holds the type its instructions expect before anything
+// runs, so the interpreter never checks a tag.
+//
+//   ADD_I64 .. MOD_I64    dst, a, b    dst = a op b on ints
+//   ADD_F64 .. DIV_F64    dst, a, b    dst = a op b on floats
+//   EQ_I64 .. LTE_F64     dst, a, b    dst = a op b, as an int 0 or 1
+//   I64_TO_F64            dst, src     dst = (f64)src
+//   MOV                   dst, src
+//   LOAD                  dst, k       dst = constant k from the pool
+//   JUMP                  target
+//   JUMP_IF_FALSE         cond, target
+//   CALL                  dst, function, first_arg, arg_count
+//   TAIL_CALL             function, first_arg, arg_count
+//   PRINT                 src
+//   RETURN                src
+//   EOP                                returns without a value
+//
+// TAIL_CALL returns what the call returns, reusing the caller's frame: the
+// arguments are moved down to the start of its registers and the callee
+// runs in their place, so tail recursion runs in constant stack.
+//
+// Superinstructions do the work of a common pair in one dispatch.  They
+// aren't emitted by the compiler, vm_load fuses them (see bytecode_fuse).
+// Both halves' register writes still happen, so fusing never has to know
+// whether a register is read later.
+//
+//   LT_I64_JUMP_IF_FALSE  dst, a, b, target
+//   ADD_I64_JUMP          dst, a, b, target
+//   LOAD_ADD_I64          tmp, k, dst, a    tmp = k, dst = a + tmp
+//   LOAD_SUB_I64          tmp, k, dst, a    tmp = k, dst = a - tmp
+//
 enum opcodes {
-  ADD = 3435001,
-  SUB,
-  MUL,
-  DIV,
-  MOD,
-  EQ,
-  NE,
-  GT,
-  GTE,
-  LT,
-  LTE,
+  ADD_I64,
+  SUB_I64,
+  MUL_I64,
+  DIV_I64,
+  MOD_I64,
+  ADD_F64,
+  SUB_F64,
+  MUL_F64,
+  DIV_F64,
+  EQ_I64,
+  NE_I64,
+  GT_I64,
+  GTE_I64,
+  LT_I64,
+  LTE_I64,
+  EQ_F64,
+  NE_F64,
+  GT_F64,
+  GTE_F64,
+  LT_F64,
+  LTE_F64,
+  I64_TO_F64,
   MOV,
+  LOAD,
   JUMP,
+  JUMP_IF_FALSE,
   CALL,
-  PUSH,
-  POP,
-  CMP,
+  TAIL_CALL,
   PRINT,
   RETURN,
   EOP,
+  LT_I64_JUMP_IF_FALSE,
+  ADD_I64_JUMP,
+  LOAD_ADD_I64,
+  LOAD_SUB_I64,
+  OPCODE_COUNT,
 };
 
 typedef enum e_ika_vm_type {
-  IKA_OP,
+  // No value, what a register holds before it's written and what a
+  // function without a result returns
+  IKA_NONE,
   IKA_INT,
   IKA_FLOAT,
   IKA_STR,
@@ -34,5 +120,84 @@ typedef enum e_ika_vm_type {
 
 typedef struct ika_value {
   e_ika_vm_type type;
-  u64 value;
+  union {
+    u64 value;
+    i64 integer;
+    f64 floating;
+    const char *string;
+  };
 } ika_value;
+
+struct vm_t;
+struct vm_program_t;
+struct vm_frame_t;
+
+// Native code for a function, see jit.h
+typedef b8 (*vm_native_t)(struct vm_t *, struct vm_program_t *,
+                          struct vm_frame_t *, ika_value *registers,
+                          ika_value *result);
+
+typedef struct vm_function_t {
+  const char *name;
+  u8 *code;
+  u32 code_size;
+  // Constants referred to by LOAD
+  ika_value *constants;
+  u32 constant_count;
+  // Arguments arrive in registers 0 to parameter_count - 1
+  u32 parameter_count;
+  e_ika_vm_type *parameter_types;
+  e_ika_vm_type return_type;
+  u32 register_count;
+  // Times the function has been called, and its native code once it's hot
+  u32 invocations;
+  vm_native_t native;
+#ifdef VM_PROFILE
+  // Where the profile keeps this function's times, plus one (0 until it
+  // has run)
+  u32 profile_slot;
+#endif
+} vm_function_t;
+
+typedef struct vm_program_t {
+  vm_function_t *functions;
+  u32 function_count;
+  // Set by vm_load once the bytecode has been verified
+  b8 verified;
+} vm_program_t;
+
+// Native code only fills in function and registers, it has no use for the
+// rest.
+typedef struct vm_frame_t {
+  vm_function_t *function;
+  const u8 *ip;
+  ika_value *registers;
+  // Where the caller wants the result, in the caller's frame
+  u32 return_register;
+} vm_frame_t;
+
+typedef struct vm_t {
+  ika_value *stack;
+  vm_frame_t *frames;
+  // Calls and taken jumps left before execution is abandoned, so code run at
+  // compile time can't hang the compiler.  Used up across vm_execute calls.
+  u64 fuel;
+  // Set when execution stops because of a runtime error
+  const char *error;
+} vm_t;
+
+void vm_init(vm_t *);
+
+// Frees the native code fn may have been compiled to while it ran.  Call it
+// before throwing fn away.
+void vm_release_function(vm_function_t *fn);
+
+// Verifies every function in program, which has to happen once before it's
+// executed.  Returns FALSE and sets vm->error if the bytecode is malformed or
+// an instruction could see an operand of the wrong type.
+b8 vm_load(vm_t *, vm_program_t *);
+
+// Runs function with the given arguments, storing what it returns in result
+// (if not NULL).  Returns FALSE and sets vm->error on a runtime error.
+b8 vm_execute(vm_t *, vm_program_t *, u32 function, ika_value *args,
+              ika_value *result);